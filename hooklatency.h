@@ -0,0 +1,235 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *   Copyright (C) 2025 Jean Chevronnet <mike.chevronnet@gmail.com>
+ *
+ * This file contains a third party module header for InspIRCd.  You can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Latency instrumentation for module hooks. Install it next to the modules
+ * which include it.
+ *
+ * A module creates one Latency::Monitor, asks it for a Histogram per hook and
+ * puts a Latency::ScopedTimer at the top of each hook. Every module reads the
+ * same config tag and answers the same /STATS symbol:
+ *
+ *   <latency enable="yes" statssymbol="j">
+ *
+ * The symbol must not be one that another module answers, e.g. H for shuns,
+ * or the latency rows are hidden behind or mixed into its output.
+ *
+ * When disabled (the default) a ScopedTimer is a single branch and the clock
+ * is never read. Enabling it on rehash starts the histograms from zero.
+ */
+
+#pragma once
+
+#include "modules/stats.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+
+namespace Latency
+{
+	class Histogram;
+	class Monitor;
+	class ScopedTimer;
+}
+
+/** Hook durations in log-linear buckets: four buckets per power of two, so a
+ * percentile is accurate to within 25%. All updates are relaxed atomics so
+ * hooks running on other threads can record without a lock.
+ */
+class Latency::Histogram final
+{
+private:
+	static constexpr size_t BUCKETS = 160;
+
+	const std::string name;
+	const bool& enabled;
+	std::atomic<uint64_t> count{ 0 };
+	std::atomic<uint64_t> total{ 0 };
+	std::atomic<uint64_t> max{ 0 };
+	std::array<std::atomic<uint64_t>, BUCKETS> buckets{};
+
+	static size_t BucketFor(uint64_t ns)
+	{
+		if (ns < 4)
+			return ns;
+
+		const unsigned int msb = 63 - __builtin_clzll(ns);
+		const size_t bucket = (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+		return std::min(bucket, BUCKETS - 1);
+	}
+
+	static uint64_t BucketLimit(size_t bucket)
+	{
+		if (bucket < 4)
+			return bucket;
+
+		const unsigned int shift = bucket / 4 - 1;
+		return ((4 + bucket % 4 + 1) << shift) - 1;
+	}
+
+public:
+	Histogram(const std::string& n, const bool& e)
+		: name(n)
+		, enabled(e)
+	{
+	}
+
+	const std::string& GetName() const { return name; }
+	bool IsEnabled() const { return enabled; }
+	uint64_t GetCount() const { return count.load(std::memory_order_relaxed); }
+	uint64_t GetTotal() const { return total.load(std::memory_order_relaxed); }
+	uint64_t GetMax() const { return max.load(std::memory_order_relaxed); }
+
+	void Record(uint64_t ns)
+	{
+		count.fetch_add(1, std::memory_order_relaxed);
+		total.fetch_add(ns, std::memory_order_relaxed);
+		buckets[BucketFor(ns)].fetch_add(1, std::memory_order_relaxed);
+
+		uint64_t current = max.load(std::memory_order_relaxed);
+		while (ns > current && !max.compare_exchange_weak(current, ns, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	/** Returns the upper bound in nanoseconds of the given percentile (0-100). */
+	uint64_t Percentile(unsigned int percent) const
+	{
+		const uint64_t samples = GetCount();
+		if (!samples)
+			return 0;
+
+		const uint64_t wanted = std::max<uint64_t>((samples * percent + 99) / 100, 1);
+		uint64_t seen = 0;
+		for (size_t bucket = 0; bucket < BUCKETS; ++bucket)
+		{
+			seen += buckets[bucket].load(std::memory_order_relaxed);
+			if (seen >= wanted)
+				return std::min(BucketLimit(bucket), GetMax());
+		}
+		return GetMax();
+	}
+
+	void Reset()
+	{
+		count.store(0, std::memory_order_relaxed);
+		total.store(0, std::memory_order_relaxed);
+		max.store(0, std::memory_order_relaxed);
+		for (auto& bucket : buckets)
+			bucket.store(0, std::memory_order_relaxed);
+	}
+};
+
+/** Times the enclosing scope if instrumentation is enabled. */
+class Latency::ScopedTimer final
+{
+private:
+	Histogram* histogram;
+	std::chrono::steady_clock::time_point start;
+
+public:
+	ScopedTimer(Histogram& h)
+		: histogram(h.IsEnabled() ? &h : nullptr)
+	{
+		if (histogram)
+			start = std::chrono::steady_clock::now();
+	}
+
+	~ScopedTimer()
+	{
+		if (histogram)
+			histogram->Record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+	}
+};
+
+/** The histograms of one module and its rows in the shared /STATS output. */
+class Latency::Monitor final
+	: public Stats::EventListener
+{
+private:
+	const std::string prefix;
+	bool enabled = false;
+	char symbol = 'j';
+
+	// A deque so that the references handed out by Add stay valid.
+	std::deque<Histogram> histograms;
+
+	static std::string FormatTime(uint64_t ns)
+	{
+		if (ns < 10000)
+			return ConvToStr(ns) + "ns";
+		if (ns < 10000000)
+			return ConvToStr(ns / 1000) + "µs";
+		return ConvToStr(ns / 1000000) + "ms";
+	}
+
+public:
+	/** @param mod The module being instrumented.
+	 * @param name A short name for the module to show in /STATS, e.g. "censorplus".
+	 */
+	Monitor(Module* mod, const std::string& name)
+		: Stats::EventListener(mod)
+		, prefix(name)
+	{
+	}
+
+	/** Returns the histogram for a hook; call this from the module constructor. */
+	Histogram& Add(const std::string& hook)
+	{
+		return histograms.emplace_back(prefix + " " + hook, enabled);
+	}
+
+	/** Reads <latency>; call this from the module's ReadConfig. */
+	void ReadConfig()
+	{
+		const auto& tag = ServerInstance->Config->ConfValue("latency");
+		const bool newenabled = tag->getBool("enable", false);
+		symbol = tag->getString("statssymbol", "j", 1, 1)[0];
+
+		if (newenabled && !enabled)
+		{
+			for (auto& histogram : histograms)
+				histogram.Reset();
+		}
+		enabled = newenabled;
+	}
+
+	ModResult OnStats(Stats::Context& stats) override
+	{
+		if (stats.GetSymbol() != symbol)
+			return MOD_RES_PASSTHRU;
+
+		for (const auto& histogram : histograms)
+		{
+			const uint64_t samples = histogram.GetCount();
+			if (!enabled || !samples)
+			{
+				stats.AddRow(998, histogram.GetName() + (enabled ? ": no samples" : ": disabled"));
+				continue;
+			}
+
+			stats.AddRow(998, INSP_FORMAT("{}: count {} avg {} p50 {} p99 {} max {}", histogram.GetName(), samples,
+				FormatTime(histogram.GetTotal() / samples), FormatTime(histogram.Percentile(50)),
+				FormatTime(histogram.Percentile(99)), FormatTime(histogram.GetMax())));
+		}
+
+		// Let the other instrumented modules add their rows too.
+		return MOD_RES_PASSTHRU;
+	}
+};
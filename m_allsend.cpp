@@ -18,103 +18,201 @@
 
 
 /// $ModAuthor: reverse mike.chevronnet@gmail.com
-/// $ModConfig: <module name="allsend">
+/// $ModConfig: <module name="allsend"> <allsend chunksize="5000">
 /// $ModDepends: core 4
 /// $ModDesc: Adds the /ALLSEND command for opers to send messages to specific groups of users.
 
 #include "inspircd.h"
+#include "clientprotocolmsg.h"
+#include <deque>
+#include <functional>
+#include <memory>
+
+/** A message that is being delivered to a snapshot of local users. The
+ * message is built once and every recipient is sent the same event, so it
+ * is only serialised once per serialiser rather than once per user.
+ */
+struct AllSendJob final
+{
+    // A copy of the source's mask rather than the user as the message is
+    // serialised lazily and the oper may quit before delivery finishes.
+    const std::string source;
+    const std::string target;
+    const std::string text;
+    ClientProtocol::Messages::Privmsg msg;
+    ClientProtocol::Event event;
+
+    // UUIDs rather than pointers as users may quit before their turn.
+    std::vector<std::string> recipients;
+    size_t position = 0;
+
+    AllSendJob(User* s, const std::string& t, const std::string& m, MessageType type)
+        : source(s->GetFullHost())
+        , target(t)
+        , text(m)
+        , msg(ClientProtocol::Messages::Privmsg::nocopy, source, target, text, type)
+        , event(ServerInstance->GetRFCEvents().privmsg, msg)
+    {
+    }
+};
+
+/** Delivers queued messages a chunk at a time so that sending to a very large
+ * number of users doesn't stall the server.
+ */
+class AllSendQueue final
+    : public Timer
+{
+private:
+    std::deque<std::unique_ptr<AllSendJob>> jobs;
+
+public:
+    size_t chunk_size = 5000;
+
+    AllSendQueue()
+        : Timer(1, true)
+    {
+    }
+
+    void Add(std::unique_ptr<AllSendJob> job)
+    {
+        jobs.push_back(std::move(job));
+        Deliver();
+    }
+
+    // Sends up to chunk_size messages from the queue.
+    void Deliver()
+    {
+        size_t budget = chunk_size;
+        while (budget && !jobs.empty())
+        {
+            AllSendJob& job = *jobs.front();
+            for (; budget && job.position < job.recipients.size(); job.position++)
+            {
+                User* found = ServerInstance->Users.FindUUID(job.recipients[job.position]);
+                LocalUser* recipient = found ? IS_LOCAL(found) : nullptr;
+                if (recipient && !recipient->quitting)
+                {
+                    recipient->Send(job.event);
+                    budget--;
+                }
+            }
+
+            if (job.position >= job.recipients.size())
+                jobs.pop_front();
+        }
+    }
+
+    bool Tick() override
+    {
+        Deliver();
+        return true;
+    }
+};
 
 class CommandAllSend : public Command
 {
+private:
+    AllSendQueue& queue;
+
 public:
-    CommandAllSend(Module* Creator)
+    CommandAllSend(Module* Creator, AllSendQueue& Queue)
         : Command(Creator, "ALLSEND", 4)
+        , queue(Queue)
     {
+        access_needed = CmdAccess::OPERATOR;
         syntax.push_back("<target> <notice|private> <local|global> <message>");
-        // Restrict command to operators using IsOper check in the Handle method
     }
 
     CmdResult Handle(User* user, const Params& parameters) override
     {
-        std::string target = parameters[0];
-        std::string mode = parameters[1];
-        std::string scope = parameters[2];
-        std::string message = parameters[3];
+        const std::string& target = parameters[0];
+        const std::string& mode = parameters[1];
+        const std::string& scope = parameters[2];
+        const std::string& message = parameters[3];
 
         bool isNotice = (mode == "notice");
         bool isLocal = (scope == "local");
 
-        auto sendMessage = [&](User* recipient) {
-            if (isNotice)
-            {
-                recipient->WriteNotice(message);
-            }
-            else
-            {
-                CommandBase::Params privmsgParams;
-                privmsgParams.push_back(recipient->nick);
-                privmsgParams.push_back(message);
-                ServerInstance->Parser.CallHandler("PRIVMSG", privmsgParams, user);
-            }
-        };
-
-        auto sendToUsers = [&](const std::function<bool(User*)>& predicate) {
-            const UserManager::LocalList& users = ServerInstance->Users.GetLocalUsers();
-            for (auto* recipient : users)
-            {
-                if (predicate(recipient))
-                {
-                    sendMessage(recipient);
-                }
-            }
-        };
-
+        std::function<bool(User*)> predicate;
         if (target == "opers")
-        {
-            sendToUsers([&](User* recipient) {
-                return recipient->IsOper() && (!isLocal || IS_LOCAL(recipient));
-            });
-            user->WriteNotice("Message sent to all opers.");
-        }
+            predicate = [](User* recipient) { return recipient->IsOper(); };
         else if (target == "users")
-        {
-            sendToUsers([&](User* recipient) {
-                return !recipient->IsOper() && (!isLocal || IS_LOCAL(recipient));
-            });
-            user->WriteNotice("Message sent to all users.");
-        }
+            predicate = [](User* recipient) { return !recipient->IsOper(); };
         else if (target == "all")
-        {
-            sendToUsers([&](User* recipient) {
-                return !isLocal || IS_LOCAL(recipient);
-            });
-            user->WriteNotice("Message sent to everyone.");
-        }
+            predicate = [](User* recipient) { return true; };
         else
         {
             user->WriteNotice("Error: Invalid target. Use 'opers', 'users', or 'all'.");
             return CmdResult::FAILURE;
         }
 
+        /* Global messages are broadcast to the other servers as a single ALLSEND
+         * each and every server delivers to its own users, so we only ever
+         * send to local users here. Notices come from the server and private
+         * messages from the oper, addressed to the server mask they went to.
+         */
+        const std::string mask = isLocal ? "$" + ServerInstance->Config->ServerName : "$*";
+        auto job = std::make_unique<AllSendJob>(isNotice ? ServerInstance->FakeClient : user, mask, message,
+            isNotice ? MessageType::NOTICE : MessageType::PRIVMSG);
+
+        const UserManager::LocalList& users = ServerInstance->Users.GetLocalUsers();
+        job->recipients.reserve(users.size());
+        for (LocalUser* recipient : users)
+        {
+            if (recipient->IsFullyConnected() && predicate(recipient))
+                job->recipients.push_back(recipient->uuid);
+        }
+        queue.Add(std::move(job));
+
+        if (IS_LOCAL(user))
+        {
+            if (target == "opers")
+                user->WriteNotice("Message sent to all opers.");
+            else if (target == "users")
+                user->WriteNotice("Message sent to all users.");
+            else
+                user->WriteNotice("Message sent to everyone.");
+        }
+
         return CmdResult::SUCCESS;
     }
+
+    RouteDescriptor GetRouting(User* user, const Params& parameters) override
+    {
+        // Servers without this module simply ignore it.
+        if (parameters[2] == "local")
+            return ROUTE_LOCALONLY;
+        return ROUTE_OPT_BCAST;
+    }
 };
 
 class ModuleAllSend : public Module
 {
 private:
+    AllSendQueue queue;
     CommandAllSend cmd;
 
 public:
     ModuleAllSend()
         : Module(VF_VENDOR, "Adds the /ALLSEND command for opers to send messages to specific groups."),
-          cmd(this)
+          cmd(this, queue)
     {
     }
 
     void init() override
     {
-        // Removed AddService call as services are automatically added since v3
+        ServerInstance->Timers.AddTimer(&queue);
+    }
+
+    void ReadConfig(ConfigStatus& status) override
+    {
+        const auto& tag = ServerInstance->Config->ConfValue("allsend");
+        queue.chunk_size = tag->getNum<size_t>("chunksize", 5000, 100);
+    }
+
+    ~ModuleAllSend() override
+    {
+        ServerInstance->Timers.DelTimer(&queue);
     }
 };
 
@@ -26,187 +26,1313 @@
 /// $CompilerFlags: -I/usr/local/include
 /// $LinkerFlags: -L/usr/local/lib -lhs
 
+// The classification core above the module class can be built without the
+// rest of the ircd by defining CENSORPLUS_BENCHMARK (see tools/censorplus_bench.cpp).
+#ifndef CENSORPLUS_BENCHMARK
 #include "inspircd.h"
 #include "modules/exemption.h"
 #include "numerichelper.h"
 #include "utility/string.h"
+#include "threadengine.h"
+#include "timeutils.h"
+#include "hooklatency.h"
+#endif
+
 #include <hs/hs.h> // Hyperscan
 #include <unicode/regex.h>
 #include <unicode/unistr.h>
 #include <codecvt>
 #include <locale>
+#include <filesystem>
 #include <fstream>
+#include <algorithm>
+#include <bitset>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
 
-typedef insp::flat_map<std::string, std::string, irc::insensitive_swo> CensorMap;
+#if defined(__AVX2__) || defined(__SSE2__)
+# include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+# include <arm_neon.h>
+#endif
 
-class ModuleCensor : public Module
+// A single badword hit reported by the badword database.
+struct CensorMatch final
 {
-private:
-	CheckExemption::EventProvider exemptionprov;
-	CensorMap censors;
-	SimpleUserMode cu;
-	SimpleChannelMode cc;
-	std::unique_ptr<icu::RegexPattern> emoji_pattern;
-	std::unique_ptr<icu::RegexPattern> kiwiirc_pattern;
-	std::string whitelist_regex_str;
-	hs_database_t* whitelist_db = nullptr;
-	hs_scratch_t* scratch = nullptr;
+	unsigned int id;
+	unsigned long long from;
+	unsigned long long to;
+};
+
+// Decodes the UTF-8 codepoint starting at pos and advances pos past it.
+// Returns false on truncated, overlong, surrogate or out of range sequences.
+static bool DecodeCodepoint(const std::string& str, size_t& pos, char32_t& cp)
+{
+	const auto* data = reinterpret_cast<const unsigned char*>(str.data());
+	const unsigned char lead = data[pos];
+	if (lead < 0x80)
+	{
+		cp = lead;
+		pos++;
+		return true;
+	}
 
-	static int onMatch(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void* ctx) {
-		bool* matched = (bool*)ctx;
-		*matched = true;
-		return 0;
+	size_t extra;
+	char32_t minimum;
+	if ((lead & 0xE0) == 0xC0)
+	{
+		cp = lead & 0x1F;
+		extra = 1;
+		minimum = 0x80;
+	}
+	else if ((lead & 0xF0) == 0xE0)
+	{
+		cp = lead & 0x0F;
+		extra = 2;
+		minimum = 0x800;
 	}
+	else if ((lead & 0xF8) == 0xF0)
+	{
+		cp = lead & 0x07;
+		extra = 3;
+		minimum = 0x10000;
+	}
+	else
+		return false;
+
+	if (str.length() - pos <= extra)
+		return false;
 
-	bool CompileRegex(const std::string& pattern, hs_database_t** db) {
-		hs_compile_error_t* compile_err;
-		if (hs_compile(pattern.c_str(), HS_FLAG_UTF8 | HS_FLAG_UCP, HS_MODE_BLOCK, nullptr, db, &compile_err) != HS_SUCCESS) {
-			ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Failed to compile regex pattern: {}", compile_err->message));
-			hs_free_compile_error(compile_err);
+	for (size_t i = 1; i <= extra; ++i)
+	{
+		const unsigned char cont = data[pos + i];
+		if ((cont & 0xC0) != 0x80)
 			return false;
+		cp = (cp << 6) | (cont & 0x3F);
+	}
+
+	if (cp < minimum || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+		return false;
+
+	pos += extra + 1;
+	return true;
+}
+
+// Returns the length of the leading run of printable ASCII (0x20-0x7E) in
+// the buffer. Most messages are entirely printable ASCII so this is checked
+// a vector at a time with the scalar loop finding the exact position.
+static size_t PrintableASCIIPrefix(const char* data, size_t length)
+{
+	size_t pos = 0;
+#if defined(__AVX2__)
+	const __m256i lower32 = _mm256_set1_epi8(0x1F);
+	const __m256i upper32 = _mm256_set1_epi8(0x7F);
+	for (; pos + 32 <= length; pos += 32)
+	{
+		// Bytes above 0x7F are negative as signed values so they fail the lower bound.
+		const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+		const __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(chunk, lower32), _mm256_cmpgt_epi8(upper32, chunk));
+		if (_mm256_movemask_epi8(ok) != -1)
+			break;
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i lower16 = _mm_set1_epi8(0x1F);
+	const __m128i upper16 = _mm_set1_epi8(0x7F);
+	for (; pos + 16 <= length; pos += 16)
+	{
+		const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+		const __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(chunk, lower16), _mm_cmpgt_epi8(upper16, chunk));
+		if (_mm_movemask_epi8(ok) != 0xFFFF)
+			break;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	const uint8x16_t lower16 = vdupq_n_u8(0x20);
+	const uint8x16_t upper16 = vdupq_n_u8(0x7E);
+	for (; pos + 16 <= length; pos += 16)
+	{
+		const uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(data + pos));
+		const uint8x16_t ok = vandq_u8(vcgeq_u8(chunk, lower16), vcleq_u8(chunk, upper16));
+		if (vminvq_u8(ok) != 0xFF)
+			break;
+	}
+#endif
+	for (; pos < length; ++pos)
+	{
+		const unsigned char c = data[pos];
+		if (c < 0x20 || c > 0x7E)
+			break;
+	}
+	return pos;
+}
+
+// The scripts which are told apart when looking for mixed script messages.
+// Han, Kana and Hangul share an entry as they are routinely written together.
+enum class Script : uint8_t
+{
+	COMMON,
+	LATIN,
+	GREEK,
+	CYRILLIC,
+	ARMENIAN,
+	HEBREW,
+	ARABIC,
+	DEVANAGARI,
+	THAI,
+	GEORGIAN,
+	CJK,
+	MATHEMATICAL
+};
+
+struct ScriptRange final
+{
+	char32_t lo;
+	char32_t hi;
+	Script script;
+};
+
+// Letter blocks of the scripts above, sorted by codepoint. Anything not listed
+// (punctuation, symbols, emoji, combining marks) is treated as common.
+static constexpr ScriptRange script_ranges[] = {
+	{ 0x00C0, 0x00D6, Script::LATIN },
+	{ 0x00D8, 0x00F6, Script::LATIN },
+	{ 0x00F8, 0x02AF, Script::LATIN },
+	{ 0x0370, 0x03FF, Script::GREEK },
+	{ 0x0400, 0x052F, Script::CYRILLIC },
+	{ 0x0531, 0x058F, Script::ARMENIAN },
+	{ 0x05D0, 0x05FF, Script::HEBREW },
+	{ 0x0600, 0x06FF, Script::ARABIC },
+	{ 0x0750, 0x077F, Script::ARABIC },
+	{ 0x0900, 0x097F, Script::DEVANAGARI },
+	{ 0x0E00, 0x0E7F, Script::THAI },
+	{ 0x10A0, 0x10FF, Script::GEORGIAN },
+	{ 0x1100, 0x11FF, Script::CJK },
+	{ 0x1C80, 0x1C8F, Script::CYRILLIC },
+	{ 0x1E00, 0x1EFF, Script::LATIN },
+	{ 0x1F00, 0x1FFF, Script::GREEK },
+	{ 0x2C60, 0x2C7F, Script::LATIN },
+	{ 0x2DE0, 0x2DFF, Script::CYRILLIC },
+	{ 0x3040, 0x30FF, Script::CJK },
+	{ 0x3130, 0x318F, Script::CJK },
+	{ 0x3400, 0x4DBF, Script::CJK },
+	{ 0x4E00, 0x9FFF, Script::CJK },
+	{ 0xA640, 0xA69F, Script::CYRILLIC },
+	{ 0xA720, 0xA7FF, Script::LATIN },
+	{ 0xAC00, 0xD7AF, Script::CJK },
+	{ 0xFB00, 0xFB06, Script::LATIN },
+	{ 0xFB1D, 0xFB4F, Script::HEBREW },
+	{ 0xFB50, 0xFDFF, Script::ARABIC },
+	{ 0xFE70, 0xFEFF, Script::ARABIC },
+	{ 0xFF21, 0xFF3A, Script::LATIN },
+	{ 0xFF41, 0xFF5A, Script::LATIN },
+	{ 0xFF66, 0xFFDC, Script::CJK },
+	{ 0x1D400, 0x1D7FF, Script::MATHEMATICAL },
+	{ 0x20000, 0x3134F, Script::CJK },
+};
+
+static constexpr bool AreScriptRangesSorted()
+{
+	for (size_t i = 1; i < std::size(script_ranges); ++i)
+	{
+		if (script_ranges[i - 1].hi >= script_ranges[i].lo)
+			return false;
+	}
+	return true;
+}
+static_assert(AreScriptRangesSorted(), "script_ranges must be sorted and must not overlap");
+
+static Script GetScript(char32_t cp)
+{
+	const auto* end = std::end(script_ranges);
+	const auto* it = std::lower_bound(std::begin(script_ranges), end, cp, [](const ScriptRange& range, char32_t value) {
+		return range.hi < value;
+	});
+	return it != end && it->lo <= cp ? it->script : Script::COMMON;
+}
+
+// The result of classifying a message in a single pass.
+enum class TextType
+{
+	// Only printable ASCII characters.
+	PRINTABLE_ASCII,
+
+	// Contains other characters but no letters from more than one script.
+	SINGLE_SCRIPT,
+
+	// Contains letters from more than one non-ASCII script.
+	MIXED_SCRIPT
+};
+
+static TextType ClassifyText(const std::string& text)
+{
+	const char* data = text.data();
+	const size_t length = text.length();
+
+	size_t pos = PrintableASCIIPrefix(data, length);
+	if (pos == length)
+		return TextType::PRINTABLE_ASCII;
+
+	Script detected = Script::COMMON;
+	while (pos < length)
+	{
+		// ASCII characters are ignored.
+		if (static_cast<unsigned char>(data[pos]) < 0x80)
+		{
+			pos++;
+			pos += PrintableASCIIPrefix(data + pos, length - pos);
+			continue;
 		}
-		return true;
+
+		char32_t cp;
+		if (!DecodeCodepoint(text, pos, cp))
+		{
+			// Malformed sequences are left for the whitelist to reject.
+			pos++;
+			continue;
+		}
+
+		const Script current = GetScript(cp);
+		if (current == Script::COMMON)
+			continue;
+
+		if (detected == Script::COMMON)
+			detected = current;
+		else if (detected != current)
+			return TextType::MIXED_SCRIPT;
+	}
+	return TextType::SINGLE_SCRIPT;
+}
+
+// Checks that every codepoint of a message falls inside a set of codepoint
+// ranges. This handles the usual "^[...]+$" style of <censorplus:emojiregex>
+// and <censorplus:kiwiircregex> in one pass over the UTF-8 text without any
+// UTF-16 conversion or allocation. Patterns it cannot express are left to ICU.
+class CodepointClassifier final
+{
+private:
+	std::vector<std::pair<char32_t, char32_t>> ranges;
+	std::bitset<128> ascii;
+	bool allow_empty = false;
+	bool compiled = false;
+
+	void AddRange(char32_t lo, char32_t hi)
+	{
+		ranges.emplace_back(lo, hi);
 	}
 
-	bool SerializeDatabase(hs_database_t* db, const std::string& filepath) {
-		char* serialized_db = nullptr;
-		size_t serialized_db_size = 0;
-		if (hs_serialize_database(db, &serialized_db, &serialized_db_size) != HS_SUCCESS) {
-			ServerInstance->Logs.Normal(MODNAME, "Failed to serialize Hyperscan database.");
+	static bool ParseHex(const std::string& pattern, size_t& pos, size_t mindigits, size_t maxdigits, char32_t& cp)
+	{
+		size_t digits = 0;
+		cp = 0;
+		while (digits < maxdigits && pos < pattern.length() && std::isxdigit(static_cast<unsigned char>(pattern[pos])))
+		{
+			const char c = pattern[pos++];
+			cp = (cp << 4) | (std::isdigit(static_cast<unsigned char>(c)) ? c - '0' : (std::tolower(static_cast<unsigned char>(c)) - 'a' + 10));
+			digits++;
+		}
+		return digits >= mindigits && cp <= 0x10FFFF;
+	}
+
+	// Parses a single literal or escaped codepoint.
+	static bool ParseCodepoint(const std::string& pattern, size_t& pos, bool inclass, char32_t& cp)
+	{
+		if (pos >= pattern.length())
 			return false;
+
+		if (pattern[pos] != '\\')
+		{
+			// Metacharacters outside of a set mean this is not a simple pattern.
+			if (!inclass && std::string_view(".()|*+?{}^$[]").find(pattern[pos]) != std::string_view::npos)
+				return false;
+			return DecodeCodepoint(pattern, pos, cp);
 		}
 
-		std::ofstream ofs(filepath, std::ios::binary);
-		if (!ofs) {
-			free(serialized_db);
-			ServerInstance->Logs.Normal(MODNAME, "Failed to open file for writing serialized Hyperscan database.");
+		if (++pos >= pattern.length())
 			return false;
+
+		const char esc = pattern[pos++];
+		switch (esc)
+		{
+			case 'x':
+				if (pos < pattern.length() && pattern[pos] == '{')
+				{
+					pos++;
+					if (!ParseHex(pattern, pos, 1, 6, cp) || pos >= pattern.length() || pattern[pos] != '}')
+						return false;
+					pos++;
+					return true;
+				}
+				return ParseHex(pattern, pos, 2, 2, cp);
+
+			case 'u':
+				return ParseHex(pattern, pos, 4, 4, cp);
+
+			case 'U':
+				return ParseHex(pattern, pos, 8, 8, cp);
+
+			case 'a':
+				cp = 0x07;
+				return true;
+
+			case 'e':
+				cp = 0x1B;
+				return true;
+
+			case 'f':
+				cp = '\f';
+				return true;
+
+			case 'n':
+				cp = '\n';
+				return true;
+
+			case 'r':
+				cp = '\r';
+				return true;
+
+			case 't':
+				cp = '\t';
+				return true;
+
+			default:
+				// Any other letter or digit is a property, class or assertion.
+				// This includes \d and \s: ICU defines them by Unicode property
+				// and the classifier would have to track ICU's exact tables.
+				if (std::isalnum(static_cast<unsigned char>(esc)))
+					return false;
+
+				// An escaped non-ASCII character is just the character itself.
+				pos--;
+				return DecodeCodepoint(pattern, pos, cp);
 		}
+	}
 
-		ofs.write(serialized_db, serialized_db_size);
-		free(serialized_db);
+	bool ParseSet(const std::string& pattern, size_t& pos)
+	{
+		pos++; // Skip the opening bracket.
+		if (pos < pattern.length() && pattern[pos] == '^')
+			return false; // Negated sets are left to ICU.
+
+		while (pos < pattern.length())
+		{
+			const char c = pattern[pos];
+			if (c == ']')
+			{
+				pos++;
+				return true;
+			}
+
+			// Nested sets and set operations are left to ICU.
+			if (c == '[' || (c == '&' && pos + 1 < pattern.length() && pattern[pos + 1] == '&'))
+				return false;
+
+			char32_t lo;
+			if (!ParseCodepoint(pattern, pos, true, lo))
+				return false;
 
-		return ofs.good();
+			char32_t hi = lo;
+			if (pos + 1 < pattern.length() && pattern[pos] == '-' && pattern[pos + 1] != ']')
+			{
+				pos++;
+				if (!ParseCodepoint(pattern, pos, true, hi) || hi < lo)
+					return false;
+			}
+			AddRange(lo, hi);
+		}
+		return false;
 	}
 
-	bool DeserializeDatabase(const std::string& filepath, hs_database_t** db) {
-		std::ifstream ifs(filepath, std::ios::binary | std::ios::ate);
-		if (!ifs) {
-			ServerInstance->Logs.Normal(MODNAME, "Failed to open file for reading serialized Hyperscan database.");
+	bool ParseTerm(const std::string& pattern, size_t& pos)
+	{
+		if (pos < pattern.length() && pattern[pos] == '[')
+			return ParseSet(pattern, pos);
+
+		char32_t cp;
+		if (!ParseCodepoint(pattern, pos, false, cp))
 			return false;
+
+		AddRange(cp, cp);
+		return true;
+	}
+
+	bool Parse(const std::string& pattern)
+	{
+		size_t pos = 0;
+		if (pos < pattern.length() && pattern[pos] == '^')
+			pos++;
+
+		if (pos < pattern.length() && pattern[pos] == '(')
+		{
+			// A group of alternatives, e.g. (?:[\x{1F600}-\x{1F64F}]|\x{2764}|\s)+
+			pos++;
+			if (pattern.compare(pos, 2, "?:") == 0)
+				pos += 2;
+
+			while (true)
+			{
+				if (!ParseTerm(pattern, pos) || pos >= pattern.length())
+					return false;
+
+				if (pattern[pos] == ')')
+				{
+					pos++;
+					break;
+				}
+
+				if (pattern[pos++] != '|')
+					return false;
+			}
 		}
+		else if (!ParseTerm(pattern, pos))
+			return false;
 
-		std::streamsize size = ifs.tellg();
-		ifs.seekg(0, std::ios::beg);
+		if (pos >= pattern.length())
+			return false;
 
-		std::vector<char> buffer(size);
-		if (!ifs.read(buffer.data(), size)) {
-			ServerInstance->Logs.Normal(MODNAME, "Failed to read serialized Hyperscan database.");
+		if (pattern[pos] == '+')
+			allow_empty = false;
+		else if (pattern[pos] == '*')
+			allow_empty = true;
+		else
 			return false;
-		}
+		pos++;
 
-		if (hs_deserialize_database(buffer.data(), size, db) != HS_SUCCESS) {
-			ServerInstance->Logs.Normal(MODNAME, "Failed to deserialize Hyperscan database.");
+		if (pos < pattern.length() && pattern[pos] == '$')
+			pos++;
+
+		return pos == pattern.length();
+	}
+
+	bool Contains(char32_t cp) const
+	{
+		auto it = std::lower_bound(ranges.begin(), ranges.end(), cp, [](const std::pair<char32_t, char32_t>& range, char32_t value) {
+			return range.second < value;
+		});
+		return it != ranges.end() && it->first <= cp;
+	}
+
+public:
+	// Compiles the pattern. Returns false if it is not a repeated set of
+	// codepoints which means it has to be matched with ICU instead.
+	bool Compile(const std::string& pattern)
+	{
+		Clear();
+		if (!Parse(pattern))
+		{
+			Clear();
 			return false;
 		}
+		compiled = true;
+
+		// Merge overlapping and adjacent ranges so lookups are a single binary search.
+		std::sort(ranges.begin(), ranges.end());
+		std::vector<std::pair<char32_t, char32_t>> merged;
+		for (const auto& range : ranges)
+		{
+			if (!merged.empty() && range.first <= merged.back().second + 1)
+				merged.back().second = std::max(merged.back().second, range.second);
+			else
+				merged.push_back(range);
+		}
+		ranges.swap(merged);
+
+		for (char32_t cp = 0; cp < 128; ++cp)
+			ascii[cp] = Contains(cp);
 
 		return true;
 	}
 
-	bool IsMatch(hs_database_t* db, const std::string& text) {
-		bool matched = false;
-		if (hs_scan(db, text.c_str(), text.length(), 0, scratch, onMatch, &matched) != HS_SUCCESS) {
-			ServerInstance->Logs.Normal(MODNAME, "Hyperscan scan error");
-		}
-		return matched;
+	void Clear()
+	{
+		ranges.clear();
+		ascii.reset();
+		compiled = false;
 	}
 
-	bool IsMixedUTF8(const std::string& text)
+	bool IsCompiled() const { return compiled; }
+
+	// Checks whether the entire text consists of allowed codepoints.
+	bool Matches(const std::string& text) const
 	{
 		if (text.empty())
-			return false;
+			return allow_empty;
 
-		enum ScriptType { SCRIPT_UNKNOWN, SCRIPT_LATIN, SCRIPT_NONLATIN };
-		ScriptType detected = SCRIPT_UNKNOWN;
+		size_t pos = 0;
+		while (pos < text.length())
+		{
+			const unsigned char c = text[pos];
+			if (c < 0x80)
+			{
+				if (!ascii[c])
+					return false;
+				pos++;
+				continue;
+			}
 
-		for (const auto& c : text)
+			char32_t cp;
+			if (!DecodeCodepoint(text, pos, cp) || !Contains(cp))
+				return false;
+		}
+		return true;
+	}
+};
+
+// What should happen to a message.
+enum class Verdict : uint8_t
+{
+	// The message can be sent as-is.
+	ALLOW,
+
+	// The message can be sent once badwords have been replaced.
+	REWRITE,
+
+	// The message contained disallowed characters.
+	BLOCK_CHARACTERS,
+
+	// The message contained a badword with no replacement.
+	BLOCK_BADWORD
+};
+
+// A <censorplus:emojiregex> or <censorplus:kiwiircregex> pattern. Patterns
+// which the codepoint classifier can express do not touch ICU at all.
+class CharacterPattern final
+{
+private:
+	CodepointClassifier classifier;
+	std::unique_ptr<icu::RegexPattern> pattern;
+
+public:
+	bool Compile(const std::string& regex, bool use_classifier, std::string& error)
+	{
+		if (use_classifier && classifier.Compile(regex))
 		{
-			if (static_cast<unsigned char>(c) < 128)
-				continue; // ASCII characters are ignored
+			pattern.reset();
+			return true;
+		}
 
-			if (std::isalpha(static_cast<unsigned char>(c)))
+		classifier.Clear();
+		UErrorCode status = U_ZERO_ERROR;
+		pattern.reset(icu::RegexPattern::compile(icu::UnicodeString::fromUTF8(regex), 0, status));
+		if (U_FAILURE(status))
+		{
+			pattern.reset();
+			error = u_errorName(status);
+			return false;
+		}
+		return true;
+	}
+
+	bool UsesClassifier() const { return classifier.IsCompiled(); }
+
+	// Checks if the entire text is matched by the pattern.
+	bool Matches(const std::string& text, UErrorCode& status) const
+	{
+		if (classifier.IsCompiled())
+			return classifier.Matches(text);
+
+		if (!pattern)
+			return false;
+
+		icu::UnicodeString ustr(text.c_str(), "UTF-8");
+		std::unique_ptr<icu::RegexMatcher> matcher(pattern->matcher(ustr, status));
+		if (U_FAILURE(status))
+			return false;
+
+		return matcher->matches(status);
+	}
+};
+
+// The <badword> tags compiled into a single Hyperscan database. Pattern ids
+// are indexes into the list of badwords.
+class BadwordList final
+{
+private:
+	hs_database_t* db = nullptr;
+	std::vector<std::pair<std::string, std::string>> badwords;
+	std::vector<CensorMatch> matches;
+
+	static int OnMatch(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void* ctx)
+	{
+		auto* list = static_cast<BadwordList*>(ctx);
+		const auto& [find, replace] = list->badwords[id];
+		list->matches.push_back({ id, to - find.length(), to });
+
+		// A blocking phrase makes the rest of the scan pointless.
+		return replace.empty() ? 1 : 0;
+	}
+
+public:
+	~BadwordList()
+	{
+		if (db)
+			hs_free_database(db);
+	}
+
+	// Replaces the badwords. On failure the existing badwords are kept.
+	bool Compile(std::vector<std::pair<std::string, std::string>>&& newbadwords, std::string& error)
+	{
+		hs_database_t* newdb = nullptr;
+		if (!newbadwords.empty())
+		{
+			// Every badword is matched as a literal so each byte is hex escaped.
+			static constexpr char hexdigits[] = "0123456789abcdef";
+			std::vector<std::string> patterns;
+			std::vector<const char*> expressions;
+			std::vector<unsigned int> flags;
+			std::vector<unsigned int> ids;
+			patterns.reserve(newbadwords.size());
+			for (const auto& [find, _] : newbadwords)
 			{
-				ScriptType current = std::islower(static_cast<unsigned char>(c)) || std::isupper(static_cast<unsigned char>(c)) ? SCRIPT_LATIN : SCRIPT_NONLATIN;
-				if (detected == SCRIPT_UNKNOWN)
-				{
-					detected = current;
-				}
-				else if (detected != current)
+				std::string pattern;
+				pattern.reserve(find.length() * 4);
+				for (const auto c : find)
 				{
-					return true; // Mixed scripts detected
+					const auto byte = static_cast<unsigned char>(c);
+					pattern.append("\\x");
+					pattern.push_back(hexdigits[byte >> 4]);
+					pattern.push_back(hexdigits[byte & 0xF]);
 				}
+				patterns.push_back(std::move(pattern));
 			}
+
+			for (size_t id = 0; id < patterns.size(); ++id)
+			{
+				expressions.push_back(patterns[id].c_str());
+				flags.push_back(HS_FLAG_CASELESS);
+				ids.push_back(static_cast<unsigned int>(id));
+			}
+
+			hs_compile_error_t* compile_err;
+			if (hs_compile_multi(expressions.data(), flags.data(), ids.data(), static_cast<unsigned int>(expressions.size()), HS_MODE_BLOCK, nullptr, &newdb, &compile_err) != HS_SUCCESS)
+			{
+				error = compile_err->message;
+				hs_free_compile_error(compile_err);
+				return false;
+			}
+		}
+
+		if (db)
+			hs_free_database(db);
+		db = newdb;
+		badwords = std::move(newbadwords);
+		return true;
+	}
+
+	// Exchanges the compiled badwords with another list.
+	void Swap(BadwordList& other)
+	{
+		std::swap(db, other.db);
+		badwords.swap(other.badwords);
+	}
+
+	hs_database_t* GetDatabase() const { return db; }
+
+	const std::string& GetText(size_t id) const { return badwords[id].first; }
+
+	// Scans the text for badwords once. On BLOCK_BADWORD blocked is set to the
+	// index of the badword and on REWRITE censored is set to the new text.
+	Verdict Scan(const std::string& text, hs_scratch_t* scratch, std::string& censored, size_t& blocked, bool& failed)
+	{
+		if (!db)
+			return Verdict::ALLOW;
+
+		matches.clear();
+		const hs_error_t err = hs_scan(db, text.c_str(), text.length(), 0, scratch, OnMatch, this);
+		if (err != HS_SUCCESS && err != HS_SCAN_TERMINATED)
+		{
+			failed = true;
+			return Verdict::ALLOW;
 		}
 
+		if (matches.empty())
+			return Verdict::ALLOW;
+
+		if (err == HS_SCAN_TERMINATED)
+		{
+			blocked = matches.back().id;
+			return Verdict::BLOCK_BADWORD;
+		}
+
+		// Prefer the leftmost and then the longest match and drop anything that
+		// overlaps a match which has already been replaced.
+		std::sort(matches.begin(), matches.end(), [](const CensorMatch& a, const CensorMatch& b) {
+			return a.from != b.from ? a.from < b.from : a.to > b.to;
+		});
+
+		censored.clear();
+		censored.reserve(text.length());
+		unsigned long long pos = 0;
+		for (const auto& match : matches)
+		{
+			if (match.from < pos)
+				continue;
+
+			censored.append(text, pos, match.from - pos);
+			censored.append(badwords[match.id].second);
+			pos = match.to;
+		}
+		censored.append(text, pos, std::string::npos);
+		return Verdict::REWRITE;
+	}
+};
+
+static bool CompileRegex(const std::string& pattern, hs_database_t** db, std::string& error)
+{
+	hs_compile_error_t* compile_err;
+	if (hs_compile(pattern.c_str(), HS_FLAG_UTF8 | HS_FLAG_UCP, HS_MODE_BLOCK, nullptr, db, &compile_err) != HS_SUCCESS)
+	{
+		error = std::string("Failed to compile regex pattern: ") + compile_err->message;
+		hs_free_compile_error(compile_err);
 		return false;
 	}
+	return true;
+}
+
+static int OnWhitelistMatch(unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void* ctx)
+{
+	bool* matched = (bool*)ctx;
+	*matched = true;
+	return 0;
+}
+
+static bool IsWhitelisted(hs_database_t* db, hs_scratch_t* scratch, const std::string& text, bool& failed)
+{
+	bool matched = false;
+	if (!db)
+		return matched;
+
+	if (hs_scan(db, text.c_str(), text.length(), 0, scratch, OnWhitelistMatch, &matched) != HS_SUCCESS)
+		failed = true;
+	return matched;
+}
+
+#ifndef CENSORPLUS_BENCHMARK
+
+typedef insp::flat_map<std::string, std::string, irc::insensitive_swo> CensorMap;
+
+// Remembers the verdicts of recently seen messages so that a flood of the same
+// payload is only classified once. This is a direct mapped table so its size
+// is fixed and a lookup is a single probe.
+class VerdictCache final
+{
+public:
+	struct Entry final
+	{
+		uint64_t hash = 0;
+		time_t expires = 0;
+		Verdict verdict = Verdict::ALLOW;
+		size_t badword = SIZE_MAX;
+		std::string text;
+		std::string censored;
+	};
+
+private:
+	std::vector<Entry> entries;
+	unsigned long ttl = 0;
+	uint64_t seed = 0;
+
+	static uint64_t Rotate(uint64_t value, unsigned int bits)
+	{
+		return (value << bits) | (value >> (64 - bits));
+	}
+
+public:
+	VerdictCache()
+	{
+		// The hash is seeded so that collisions can not be precomputed.
+		ServerInstance->GenRandom(reinterpret_cast<char*>(&seed), sizeof(seed));
+	}
+
+	// Empties the cache and changes its size. A size of zero disables it.
+	void Reset(size_t size, unsigned long newttl)
+	{
+		std::vector<Entry> newentries(size);
+		entries.swap(newentries);
+		ttl = newttl;
+	}
+
+	// Empties the cache without changing its size.
+	void Clear()
+	{
+		for (auto& entry : entries)
+			entry = Entry();
+	}
+
+	bool IsEnabled() const { return !entries.empty(); }
+
+	// A seeded multiply-rotate hash which consumes eight bytes per round.
+	uint64_t Hash(const std::string& text) const
+	{
+		const char* data = text.data();
+		size_t length = text.length();
+		uint64_t hash = seed ^ (length * 0x9E3779B97F4A7C15ULL);
+		for (; length >= 8; data += 8, length -= 8)
+		{
+			uint64_t block;
+			memcpy(&block, data, sizeof(block));
+			hash ^= block * 0xBF58476D1CE4E5B9ULL;
+			hash = Rotate(hash, 31) * 0x94D049BB133111EBULL;
+		}
+
+		if (length)
+		{
+			uint64_t block = 0;
+			memcpy(&block, data, length);
+			hash ^= block * 0xBF58476D1CE4E5B9ULL;
+			hash = Rotate(hash, 31) * 0x94D049BB133111EBULL;
+		}
+
+		hash ^= hash >> 32;
+		hash *= 0xD6E8FEB86659FD93ULL;
+		hash ^= hash >> 32;
+		return hash;
+	}
+
+	const Entry* Find(uint64_t hash, const std::string& text) const
+	{
+		if (entries.empty())
+			return nullptr;
+
+		const Entry& entry = entries[hash % entries.size()];
+		if (entry.hash != hash || entry.expires <= ServerInstance->Time() || entry.text != text)
+			return nullptr;
+
+		return &entry;
+	}
+
+	void Store(uint64_t hash, const std::string& text, Verdict verdict, size_t badword, const std::string& censored)
+	{
+		if (entries.empty())
+			return;
+
+		Entry& entry = entries[hash % entries.size()];
+		entry.hash = hash;
+		entry.expires = ServerInstance->Time() + ttl;
+		entry.verdict = verdict;
+		entry.badword = badword;
+		entry.text = text;
+		if (verdict == Verdict::REWRITE)
+			entry.censored = censored;
+		else
+			entry.censored.clear();
+	}
+};
+
+// Blocks of the same payload which have not been announced individually.
+struct BlockSummary final
+{
+	std::string payload;
+	std::string reason;
+	unsigned long repeats = 0;
+	std::unordered_set<std::string> users;
+};
+
+// These are used from the whitelist compiler thread so they must not log.
+static bool SerializeDatabase(hs_database_t* db, const std::string& filepath, std::string& error)
+{
+	char* serialized_db = nullptr;
+	size_t serialized_db_size = 0;
+	if (hs_serialize_database(db, &serialized_db, &serialized_db_size) != HS_SUCCESS)
+	{
+		error = "Failed to serialize Hyperscan database.";
+		return false;
+	}
+
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path(filepath).parent_path(), ec);
+
+	// Write to a temporary file first so a reader never sees a partial database.
+	const std::string temppath = filepath + ".tmp";
+	std::ofstream ofs(temppath, std::ios::binary);
+	if (!ofs)
+	{
+		free(serialized_db);
+		error = INSP_FORMAT("Failed to open {} for writing serialized Hyperscan database.", temppath);
+		return false;
+	}
+
+	ofs.write(serialized_db, serialized_db_size);
+	free(serialized_db);
+	ofs.close();
+
+	if (!ofs.good())
+	{
+		error = INSP_FORMAT("Failed to write serialized Hyperscan database to {}.", temppath);
+		return false;
+	}
+
+	std::filesystem::rename(temppath, filepath, ec);
+	if (ec)
+	{
+		error = INSP_FORMAT("Failed to rename {} to {}: {}", temppath, filepath, ec.message());
+		return false;
+	}
+	return true;
+}
+
+static bool DeserializeDatabase(const std::string& filepath, hs_database_t** db, std::string& error)
+{
+	std::ifstream ifs(filepath, std::ios::binary | std::ios::ate);
+	if (!ifs)
+	{
+		error = INSP_FORMAT("Failed to open {} for reading serialized Hyperscan database.", filepath);
+		return false;
+	}
+
+	std::streamsize size = ifs.tellg();
+	ifs.seekg(0, std::ios::beg);
+
+	std::vector<char> buffer(size);
+	if (!ifs.read(buffer.data(), size))
+	{
+		error = INSP_FORMAT("Failed to read serialized Hyperscan database from {}.", filepath);
+		return false;
+	}
+
+	if (hs_deserialize_database(buffer.data(), size, db) != HS_SUCCESS)
+	{
+		error = INSP_FORMAT("Failed to deserialize Hyperscan database from {}.", filepath);
+		return false;
+	}
+
+	return true;
+}
+
+// Works out the name of the serialized whitelist database. This is keyed on
+// everything that affects the compiled database so that a stale file from an
+// older pattern, Hyperscan version or CPU is never loaded.
+static std::string GetWhitelistCachePath(const std::string& cachedir, const std::string& pattern)
+{
+	// 64-bit FNV-1a as it is stable across builds and standard libraries.
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const auto update = [&hash](const void* data, size_t length) {
+		const auto* bytes = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < length; ++i)
+		{
+			hash ^= bytes[i];
+			hash *= 0x100000001b3ULL;
+		}
+		hash ^= 0xFF;
+		hash *= 0x100000001b3ULL;
+	};
+
+	const char* version = hs_version();
+	update(pattern.data(), pattern.length());
+	update(version, strlen(version));
+
+	hs_platform_info_t platform = {};
+	if (hs_populate_platform(&platform) == HS_SUCCESS)
+	{
+		update(&platform.tune, sizeof(platform.tune));
+		update(&platform.cpu_features, sizeof(platform.cpu_features));
+	}
+
+	const unsigned int flags = HS_FLAG_UTF8 | HS_FLAG_UCP;
+	update(&flags, sizeof(flags));
+
+	return INSP_FORMAT("{}/whitelist-{:016x}.hsdb", cachedir, hash);
+}
+
+class ModuleCensor;
+
+// Compiles the whitelist database away from the main thread and writes it to
+// the cache. The result is picked up by the module from the main loop.
+class WhitelistCompiler final
+	: public SocketThread
+{
+private:
+	ModuleCensor* const mod;
+
+public:
+	const std::string pattern;
+	const std::string cachepath;
+	const uint64_t generation;
+	hs_database_t* db = nullptr;
+	std::string error;
+	std::string warning;
+	bool finished = false;
+
+	WhitelistCompiler(ModuleCensor* m, const std::string& p, const std::string& cp, uint64_t gen)
+		: mod(m)
+		, pattern(p)
+		, cachepath(cp)
+		, generation(gen)
+	{
+	}
+
+	~WhitelistCompiler() override
+	{
+		if (db)
+			hs_free_database(db);
+	}
+
+	void OnStart() override
+	{
+		hs_database_t* newdb = nullptr;
+		std::string newerror;
+		std::string newwarning;
+		if (CompileRegex(pattern, &newdb, newerror))
+			SerializeDatabase(newdb, cachepath, newwarning);
+
+		LockQueue();
+		db = newdb;
+		error = std::move(newerror);
+		warning = std::move(newwarning);
+		UnlockQueue();
+		NotifyParent();
+	}
+
+	void OnNotify() override;
+};
+
+// Periodically announces the blocks which were coalesced.
+class SummaryTimer final
+	: public Timer
+{
+private:
+	ModuleCensor* const mod;
+
+public:
+	SummaryTimer(ModuleCensor* m, unsigned long interval)
+		: Timer(interval, true)
+		, mod(m)
+	{
+	}
+
+	bool Tick() override;
+};
+
+class ModuleCensor : public Module
+{
+private:
+	CheckExemption::EventProvider exemptionprov;
+	CensorMap censors;
+	BadwordList badwords;
+	SimpleUserMode cu;
+	SimpleChannelMode cc;
+	CharacterPattern emoji_pattern;
+	CharacterPattern kiwiirc_pattern;
+	std::string whitelist_regex_str;
+	std::string whitelist_cachedir;
+	std::string whitelist_cachepath; // The cache entry of the database in use.
+	std::vector<std::unique_ptr<WhitelistCompiler>> whitelist_compilers;
+	uint64_t whitelist_generation = 0;
+	hs_database_t* whitelist_db = nullptr;
+	hs_scratch_t* scratch = nullptr;
+	VerdictCache verdicts;
+	std::unique_ptr<SummaryTimer> summarytimer;
+	Latency::Monitor latency;
+	Latency::Histogram& premessage_latency;
+	unsigned long summaryinterval = 0;
+	std::unordered_map<uint64_t, BlockSummary> summaries;
+
+	Verdict CheckText(const std::string& text, std::string& censored, size_t& blocked, bool& cacheable)
+	{
+		// ASCII characters and common symbols are allowed by default.
+		const TextType type = ClassifyText(text);
+		cacheable = type != TextType::PRINTABLE_ASCII;
+		if (type == TextType::MIXED_SCRIPT || (cacheable && !IsAllowed(text)))
+			return Verdict::BLOCK_CHARACTERS;
+
+		bool failed = false;
+		const Verdict verdict = badwords.Scan(text, scratch, censored, blocked, failed);
+		if (failed)
+			ServerInstance->Logs.Normal(MODNAME, "Hyperscan badword scan error");
+
+		if (verdict != Verdict::ALLOW)
+			cacheable = true;
+		return verdict;
+	}
+
+	// Announces a block to opers. Repeats of a payload which has already been
+	// announced are counted and reported in a summary by the timer instead.
+	void AnnounceBlock(uint64_t hash, User* user, const std::string& payload, const std::string& reason, const std::string& announcement)
+	{
+		if (!summaryinterval)
+		{
+			ServerInstance->SNO.WriteGlobalSno('a', announcement);
+			return;
+		}
+
+		auto [it, inserted] = summaries.try_emplace(hash);
+		BlockSummary& summary = it->second;
+		if (inserted)
+		{
+			summary.payload = payload;
+			summary.reason = reason;
+			ServerInstance->SNO.WriteGlobalSno('a', announcement);
+			return;
+		}
+
+		summary.repeats++;
+		summary.users.insert(user->uuid);
+	}
 
 	bool IsEmojiOnly(const std::string& text)
 	{
 		UErrorCode status = U_ZERO_ERROR;
-		icu::UnicodeString ustr(text.c_str(), "UTF-8");
-		std::unique_ptr<icu::RegexMatcher> emoji_matcher(emoji_pattern->matcher(ustr, status));
+		const bool matched = emoji_pattern.Matches(text, status);
 		if (U_FAILURE(status))
-		{
 			ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Failed to create regex matcher for emojis: {}", u_errorName(status)));
-			return false;
-		}
-
-		// Check if the entire text is matched by the emoji pattern
-		return emoji_matcher->matches(status);
+		return matched;
 	}
 
 	bool IsKiwiIRCOnly(const std::string& text)
 	{
 		UErrorCode status = U_ZERO_ERROR;
-		icu::UnicodeString ustr(text.c_str(), "UTF-8");
-		std::unique_ptr<icu::RegexMatcher> kiwiirc_matcher(kiwiirc_pattern->matcher(ustr, status));
+		const bool matched = kiwiirc_pattern.Matches(text, status);
 		if (U_FAILURE(status))
-		{
 			ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Failed to create regex matcher for KiwiIRC: {}", u_errorName(status)));
+		return matched;
+	}
+
+	// Checks text which is not entirely printable ASCII against the whitelists.
+	bool IsAllowed(const std::string& text)
+	{
+		// First, try to match the whitelist using Hyperscan
+		bool failed = false;
+		const bool whitelisted = IsWhitelisted(whitelist_db, scratch, text, failed);
+		if (failed)
+			ServerInstance->Logs.Normal(MODNAME, "Hyperscan scan error");
+		if (whitelisted)
+			return true;
+
+		// Then, try to match the text against emoji and KiwiIRC patterns
+		return IsEmojiOnly(text) || IsKiwiIRCOnly(text);
+	}
+
+	void CleanupCompilers(bool all)
+	{
+		for (auto it = whitelist_compilers.begin(); it != whitelist_compilers.end(); )
+		{
+			if (all || (*it)->finished)
+			{
+				// This waits for a running compile to finish.
+				(*it)->Stop();
+				it = whitelist_compilers.erase(it);
+			}
+			else
+				++it;
+		}
+	}
+
+	// Replaces the whitelist database. This is only called from the main loop
+	// so messages never see a database without matching scratch space.
+	bool SwapWhitelist(hs_database_t* db)
+	{
+		if (hs_alloc_scratch(db, &scratch) != HS_SUCCESS)
+		{
+			hs_free_database(db);
 			return false;
 		}
 
-		// Check if the entire text is matched by the KiwiIRC pattern
-		return kiwiirc_matcher->matches(status);
+		if (whitelist_db)
+			hs_free_database(whitelist_db);
+		whitelist_db = db;
+		return true;
 	}
 
-	bool IsAllowed(const std::string& text)
+	void LoadWhitelist()
 	{
-		// Allow ASCII characters and common symbols by default
-		if (std::all_of(text.begin(), text.end(), [](unsigned char c) { return c >= 32 && c <= 126; }))
+		const std::string cachepath = GetWhitelistCachePath(whitelist_cachedir, whitelist_regex_str);
+		const uint64_t generation = ++whitelist_generation;
+		if (whitelist_db && cachepath == whitelist_cachepath)
+			return; // Nothing has changed.
+
+		std::string error;
+		hs_database_t* db = nullptr;
+		if (DeserializeDatabase(cachepath, &db, error))
 		{
-			return true;
+			if (!SwapWhitelist(db))
+				throw ModuleException(this, "Failed to allocate Hyperscan scratch space");
+			whitelist_cachepath = cachepath;
+			return;
 		}
+		ServerInstance->Logs.Debug(MODNAME, error);
 
-		// First, try to match the whitelist using Hyperscan
-		if (IsMatch(whitelist_db, text))
-			return true;
+		if (!whitelist_db)
+		{
+			// There is no old database to keep serving so this has to be done now.
+			if (!CompileRegex(whitelist_regex_str, &db, error))
+				throw ModuleException(this, INSP_FORMAT("Failed to compile whitelist regex pattern for Hyperscan: {}", error));
 
-		// Then, try to match the text against emoji and KiwiIRC patterns using ICU
-		return IsEmojiOnly(text) || IsKiwiIRCOnly(text);
+			if (!SerializeDatabase(db, cachepath, error))
+				ServerInstance->Logs.Normal(MODNAME, error);
+
+			if (!SwapWhitelist(db))
+				throw ModuleException(this, "Failed to allocate Hyperscan scratch space");
+			whitelist_cachepath = cachepath;
+			return;
+		}
+
+		ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Compiling the whitelist database in the background; the previous database will be used until it is ready ({})", cachepath));
+		auto compiler = std::make_unique<WhitelistCompiler>(this, whitelist_regex_str, cachepath, generation);
+		compiler->Start();
+		whitelist_compilers.push_back(std::move(compiler));
 	}
 
 public:
+	void FlushSummaries()
+	{
+		for (const auto& [_, summary] : summaries)
+		{
+			if (!summary.repeats)
+				continue;
+
+			ServerInstance->SNO.WriteGlobalSno('a', INSP_FORMAT("CensorPlus: {} repeats of payload '{}' ({}) from {} users were blocked in the last {}.",
+				summary.repeats, summary.payload, summary.reason, summary.users.size(), Duration::ToString(summaryinterval)));
+		}
+		summaries.clear();
+	}
+
+	void OnWhitelistCompiled(WhitelistCompiler* compiler)
+	{
+		compiler->finished = true;
+		if (!compiler->warning.empty())
+			ServerInstance->Logs.Normal(MODNAME, compiler->warning);
+
+		if (!compiler->db)
+		{
+			ServerInstance->SNO.WriteGlobalSno('a', INSP_FORMAT("CensorPlus: Failed to compile the whitelist database, the previous database will continue to be used: {}", compiler->error));
+			return;
+		}
+
+		// A newer rehash has superseded this compile.
+		if (compiler->generation != whitelist_generation)
+			return;
+
+		hs_database_t* db = compiler->db;
+		compiler->db = nullptr;
+		if (!SwapWhitelist(db))
+		{
+			ServerInstance->SNO.WriteGlobalSno('a', "CensorPlus: Failed to allocate Hyperscan scratch space for the new whitelist database.");
+			return;
+		}
+		whitelist_cachepath = compiler->cachepath;
+
+		// Verdicts from the old whitelist may no longer be correct.
+		verdicts.Clear();
+		ServerInstance->SNO.WriteGlobalSno('a', "CensorPlus: The new whitelist database is now in use.");
+	}
+
 	ModuleCensor()
 		: Module(VF_NONE, "Allows the server administrator to define inappropriate phrases that are not allowed to be used in private or channel messages and blocks messages with mixed UTF-8 scripts, only allowing certain Unicode smileys.")
 		, exemptionprov(this)
 		, cu(this, "u_censor", 'G')
 		, cc(this, "censor", 'G')
+		, latency(this, "censorplus")
+		, premessage_latency(latency.Add("OnUserPreMessage"))
 	{
 	}
 
 	~ModuleCensor() override {
+		if (summarytimer)
+			ServerInstance->Timers.DelTimer(summarytimer.get());
+		CleanupCompilers(true);
 		if (whitelist_db)
 			hs_free_database(whitelist_db);
 		if (scratch)
@@ -215,6 +1341,9 @@ public:
 
 	void ReadConfig(ConfigStatus& status) override
 	{
+		latency.ReadConfig();
+		CleanupCompilers(false);
+
 		CensorMap newcensors;
 		for (const auto& [_, badword_tag] : ServerInstance->Config->ConfTags("badword"))
 		{
@@ -225,41 +1354,83 @@ public:
 			const std::string replace = badword_tag->getString("replace");
 			newcensors[text] = replace;
 		}
-		censors.swap(newcensors);
+
+		// Everything is built into locals first so that a config error leaves
+		// the module using its previous configuration.
+		BadwordList newbadwords;
+		std::vector<std::pair<std::string, std::string>> newbadwordlist(newcensors.begin(), newcensors.end());
+		std::string badword_error;
+		if (!newbadwords.Compile(std::move(newbadwordlist), badword_error))
+			throw ModuleException(this, INSP_FORMAT("Failed to compile badword patterns for Hyperscan: {}", badword_error));
 
 		const auto& tag = ServerInstance->Config->ConfValue("censorplus");
 		std::string emoji_regex_str = tag->getString("emojiregex");
-		whitelist_regex_str = tag->getString("whitelistregex");
 		std::string kiwiirc_regex_str = tag->getString("kiwiircregex");
 
-		UErrorCode icu_status = U_ZERO_ERROR;
-		emoji_pattern = std::unique_ptr<icu::RegexPattern>(icu::RegexPattern::compile(icu::UnicodeString::fromUTF8(emoji_regex_str), 0, icu_status));
-		if (U_FAILURE(icu_status))
-		{
-			throw ModuleException(this, INSP_FORMAT("Failed to compile emoji regex pattern: {}", u_errorName(icu_status)));
-		}
+		// Simple codepoint set patterns are matched without ICU.
+		const bool use_classifier = tag->getBool("codepointclassifier", true);
+		std::string pattern_error;
+		CharacterPattern newemoji;
+		if (!newemoji.Compile(emoji_regex_str, use_classifier, pattern_error))
+			throw ModuleException(this, INSP_FORMAT("Failed to compile emoji regex pattern: {}", pattern_error));
+		if (use_classifier && !newemoji.UsesClassifier())
+			ServerInstance->Logs.Normal(MODNAME, "<censorplus:emojiregex> is too complex for the codepoint classifier; falling back to ICU");
 
-		icu_status = U_ZERO_ERROR;
-		kiwiirc_pattern = std::unique_ptr<icu::RegexPattern>(icu::RegexPattern::compile(icu::UnicodeString::fromUTF8(kiwiirc_regex_str), 0, icu_status));
-		if (U_FAILURE(icu_status))
-		{
-			throw ModuleException(this, INSP_FORMAT("Failed to compile KiwiIRC regex pattern: {}", u_errorName(icu_status)));
-		}
+		CharacterPattern newkiwiirc;
+		if (!newkiwiirc.Compile(kiwiirc_regex_str, use_classifier, pattern_error))
+			throw ModuleException(this, INSP_FORMAT("Failed to compile KiwiIRC regex pattern: {}", pattern_error));
+		if (use_classifier && !newkiwiirc.UsesClassifier())
+			ServerInstance->Logs.Normal(MODNAME, "<censorplus:kiwiircregex> is too complex for the codepoint classifier; falling back to ICU");
 
-		const std::string db_path = "/home/debian/irc/ircd/inspircd/run/conf/hyperscan/whitelist.hsdb";
-		if (!DeserializeDatabase(db_path, &whitelist_db)) {
-			if (!CompileRegex(whitelist_regex_str, &whitelist_db) || !SerializeDatabase(whitelist_db, db_path)) {
-				throw ModuleException(this, "Failed to compile or serialize whitelist regex pattern for Hyperscan");
-			}
-		}
+		const size_t verdictcachesize = tag->getNum<size_t>("verdictcachesize", 4096, 0, 1048576);
+		const unsigned long verdictcachettl = tag->getDuration("verdictcachettl", 60, 1);
+		const unsigned long newsummaryinterval = tag->getDuration("summaryinterval", 10);
+		const std::string newcachedir = ServerInstance->Config->Paths.PrependData(tag->getString("cachedir", "hyperscan", 1));
 
-		if (hs_alloc_scratch(whitelist_db, &scratch) != HS_SUCCESS) {
-			throw ModuleException(this, "Failed to allocate Hyperscan scratch space");
+		// The scratch space is shared so it must also be large enough for the
+		// new badword database. Growing it keeps it valid for the old one.
+		if (newbadwords.GetDatabase() && hs_alloc_scratch(newbadwords.GetDatabase(), &scratch) != HS_SUCCESS)
+			throw ModuleException(this, "Failed to allocate Hyperscan scratch space for badwords");
+
+		// This compiles the whitelist synchronously on the first load and so
+		// is the last step which can fail.
+		whitelist_regex_str = tag->getString("whitelistregex");
+		whitelist_cachedir = newcachedir;
+		LoadWhitelist();
+
+		censors.swap(newcensors);
+		badwords.Swap(newbadwords);
+		emoji_pattern = std::move(newemoji);
+		kiwiirc_pattern = std::move(newkiwiirc);
+
+		// Verdicts depend on the configuration so the cache is always emptied.
+		verdicts.Reset(verdictcachesize, verdictcachettl);
+
+		if (newsummaryinterval != summaryinterval)
+		{
+			FlushSummaries();
+			summaryinterval = newsummaryinterval;
+			if (summaryinterval)
+			{
+				if (!summarytimer)
+				{
+					summarytimer = std::make_unique<SummaryTimer>(this, summaryinterval);
+					ServerInstance->Timers.AddTimer(summarytimer.get());
+				}
+				else
+					summarytimer->SetInterval(summaryinterval);
+			}
+			else if (summarytimer)
+			{
+				ServerInstance->Timers.DelTimer(summarytimer.get());
+				summarytimer.reset();
+			}
 		}
 	}
 
 	ModResult OnUserPreMessage(User* user, MessageTarget& target, MessageDetails& details) override
 	{
+		Latency::ScopedTimer latencytimer(premessage_latency);
 		if (!IS_LOCAL(user))
 			return MOD_RES_PASSTHRU;
 
@@ -294,7 +1465,33 @@ public:
 				return MOD_RES_PASSTHRU;
 			}
 
-			if (IsMixedUTF8(details.text) || !IsAllowed(details.text))
+			const uint64_t hash = verdicts.IsEnabled() || summaryinterval ? verdicts.Hash(details.text) : 0;
+
+			Verdict verdict;
+			size_t blocked = SIZE_MAX;
+			std::string censored;
+			if (const auto* entry = verdicts.Find(hash, details.text))
+			{
+				verdict = entry->verdict;
+				blocked = entry->badword;
+				if (verdict == Verdict::REWRITE)
+					censored = entry->censored;
+			}
+			else
+			{
+				bool cacheable;
+				verdict = CheckText(details.text, censored, blocked, cacheable);
+				if (cacheable)
+					verdicts.Store(hash, details.text, verdict, blocked, censored);
+			}
+
+			if (verdict == Verdict::REWRITE)
+			{
+				details.text.swap(censored);
+				return MOD_RES_PASSTHRU;
+			}
+
+			if (verdict == Verdict::BLOCK_CHARACTERS)
 			{
 				const std::string msg = "Your message contained disallowed characters and was blocked. IRC operators have been notified (Spamfilter purpose).";
 
@@ -304,51 +1501,43 @@ public:
 				{
 					auto* targchan = target.Get<Channel>();
 					oper_announcement = INSP_FORMAT("MixedCharacterUTF8: User {} in channel {} sent a message containing disallowed characters: '{}', which was blocked.", user->nick, targchan->name, details.text);
-					ServerInstance->SNO.WriteGlobalSno('a', oper_announcement);
+					AnnounceBlock(hash, user, details.text, "disallowed characters", oper_announcement);
 					user->WriteNumeric(Numerics::CannotSendTo(targchan, msg));
 				}
 				else
 				{
 					auto* targuser = target.Get<User>();
 					oper_announcement = INSP_FORMAT("MixedCharacterUTF8: User {} sent a private message to {} containing disallowed characters: '{}', which was blocked.", user->nick, targuser->nick, details.text);
-					ServerInstance->SNO.WriteGlobalSno('a', oper_announcement);
+					AnnounceBlock(hash, user, details.text, "disallowed characters", oper_announcement);
 					user->WriteNumeric(Numerics::CannotSendTo(targuser, msg));
 				}
 				return MOD_RES_DENY;
 			}
 
-			for (const auto& [find, replace] : censors)
+			if (verdict == Verdict::BLOCK_BADWORD)
 			{
-				size_t censorpos;
-				while ((censorpos = irc::find(details.text, find)) != std::string::npos)
+				const std::string& find = badwords.GetText(blocked);
+				const std::string msg = INSP_FORMAT("Your message to this channel contained a banned phrase ({}) and was blocked. IRC operators have been notified (Spamfilter purpose).", find);
+
+				// Announce to opers
+				std::string oper_announcement;
+				if (target.type == MessageTarget::TYPE_CHANNEL)
+				{
+					auto* targchan = target.Get<Channel>();
+					oper_announcement = INSP_FORMAT("CensorPlus: User {} in channel {} sent a message containing banned phrase ({}): '{}', which was blocked.", user->nick, targchan->name, find, details.text);
+				}
+				else
 				{
-					if (replace.empty())
-					{
-						const std::string msg = INSP_FORMAT("Your message to this channel contained a banned phrase ({}) and was blocked. IRC operators have been notified (Spamfilter purpose).", find);
-
-						// Announce to opers
-						std::string oper_announcement;
-						if (target.type == MessageTarget::TYPE_CHANNEL)
-						{
-							auto* targchan = target.Get<Channel>();
-							oper_announcement = INSP_FORMAT("CensorPlus: User {} in channel {} sent a message containing banned phrase ({}): '{}', which was blocked.", user->nick, targchan->name, find, details.text);
-						}
-						else
-						{
-							auto* targuser = target.Get<User>();
-							oper_announcement = INSP_FORMAT("CensorPlus: User {} sent a private message to {} containing banned phrase ({}): '{}', which was blocked.", user->nick, targuser->nick, find, details.text);
-						}
-						ServerInstance->SNO.WriteGlobalSno('a', oper_announcement);
-
-						if (target.type == MessageTarget::TYPE_CHANNEL)
-							user->WriteNumeric(Numerics::CannotSendTo(target.Get<Channel>(), msg));
-						else
-							user->WriteNumeric(Numerics::CannotSendTo(target.Get<User>(), msg));
-						return MOD_RES_DENY;
-					}
-
-					details.text.replace(censorpos, find.size(), replace);
+					auto* targuser = target.Get<User>();
+					oper_announcement = INSP_FORMAT("CensorPlus: User {} sent a private message to {} containing banned phrase ({}): '{}', which was blocked.", user->nick, targuser->nick, find, details.text);
 				}
+				AnnounceBlock(hash, user, details.text, INSP_FORMAT("banned phrase {}", find), oper_announcement);
+
+				if (target.type == MessageTarget::TYPE_CHANNEL)
+					user->WriteNumeric(Numerics::CannotSendTo(target.Get<Channel>(), msg));
+				else
+					user->WriteNumeric(Numerics::CannotSendTo(target.Get<User>(), msg));
+				return MOD_RES_DENY;
 			}
 		} catch (const std::exception& e) {
 			ServerInstance->Logs.Normal(MODNAME, INSP_FORMAT("Exception in OnUserPreMessage: {}", e.what()));
@@ -358,6 +1547,21 @@ public:
 	}
 };
 
+bool SummaryTimer::Tick()
+{
+	mod->FlushSummaries();
+	return true;
+}
+
+void WhitelistCompiler::OnNotify()
+{
+	LockQueue();
+	mod->OnWhitelistCompiled(this);
+	UnlockQueue();
+}
+
 MODULE_INIT(ModuleCensor)
 
+#endif
+
 
@@ -21,6 +21,7 @@
 /// $ModDepends: core 4
 
 #include "inspircd.h"
+#include "hooklatency.h"
 
 class CommandSetNickIdent : public Command
 {
@@ -63,16 +64,26 @@ class ModuleSetNickIdent : public Module
 {
 private:
 	CommandSetNickIdent cmd;
+	Latency::Monitor latency;
+	Latency::Histogram& connect_latency;
 
 public:
 	ModuleSetNickIdent()
 		: Module(VF_VENDOR, "Sets the user's ident to match their nickname on connect.")
 		, cmd(this)
+		, latency(this, "changeidentonick")
+		, connect_latency(latency.Add("OnUserConnect"))
 	{
 	}
 
+	void ReadConfig(ConfigStatus& status) override
+	{
+		latency.ReadConfig();
+	}
+
 	void OnUserConnect(LocalUser* user) override
 	{
+		Latency::ScopedTimer latencytimer(connect_latency);
 		if (IS_LOCAL(user))
 		{
 			std::string newident = user->nick;
@@ -20,32 +20,312 @@
 /// $ModAuthorMail: revrsedev@email.com
 /// $ModDepends: core 4
 /// $ModDesc: Warns IRC operators and Z-lines botnets trying to use WebSockets.
+/// $ModConfig: <detectfakewebsocket port="8083" origin="kiwiirc.com,*.kiwiirc.com" zline_duration="1h" zline_reason="Botnet detected using WebSockets!" snomask="a" warninterval="10s"
+///             window="1m" tablesize="4096" prefixlimit="0" originlimit="0" ipv4prefix="24" ipv6prefix="64" statssymbol="W">
+///             <!-- Each origin must match the host exactly; use "*.host" to also allow its subdomains.
+///                  Entries written as URLs such as "https://kiwiirc.com:443" are reduced to their host. -->
 
 #include "inspircd.h"
 #include "xline.h"
 #include "extension.h"
+#include "modules/stats.h"
+#include "hooklatency.h"
+#include <algorithm>
+#include <map>
+#include <string_view>
+#include <unordered_set>
 
-class ModuleDetectFakeWebSocket final : public Module
+// Matches WebSocket origins against the configured hosts. Each entry is
+// either an exact host ("kiwiirc.com") or a wildcard for its subdomains
+// ("*.kiwiirc.com"). Hosts are stored as a trie of labels from the TLD down
+// so a lookup only walks the labels of the origin being checked.
+class OriginMatcher final
 {
 private:
-    int websocket_port;
-    std::vector<std::string> allowed_origins;
-    int zline_duration;
-    std::string zline_reason;
+    struct Node final
+    {
+        std::map<std::string, size_t, std::less<>> children;
+        bool exact = false;
+        bool subdomains = false;
+    };
 
-    // Reference to the existing WebSocket Origin extension from m_websocket.cpp
-    StringExtItem* websocket_origin;
+    std::vector<Node> nodes;
+
+    // Calls fn with each label of host from right to left; stops early if fn returns false.
+    template<typename Func>
+    static void ForEachLabel(std::string_view host, Func&& fn)
+    {
+        while (!host.empty())
+        {
+            const size_t dot = host.rfind('.');
+            const std::string_view label = dot == std::string_view::npos ? host : host.substr(dot + 1);
+            host = dot == std::string_view::npos ? std::string_view() : host.substr(0, dot);
+            if (!fn(label, host.empty()))
+                return;
+        }
+    }
+
+public:
+    OriginMatcher()
+        : nodes(1)
+    {
+    }
+
+    // Returns false if the entry is not a usable host. Entries may be written
+    // like an Origin header, e.g. "https://kiwiirc.com:443".
+    bool Add(const std::string& origin)
+    {
+        std::string entry = ExtractHost(origin);
+        bool wildcard = false;
+        if (entry.compare(0, 2, "*.") == 0)
+        {
+            wildcard = true;
+            entry.erase(0, 2);
+        }
+
+        if (entry.empty() || entry.find_first_of("*?/:") != std::string::npos)
+            return false;
+
+        size_t current = 0;
+        ForEachLabel(entry, [&](std::string_view label, bool) {
+            auto it = nodes[current].children.find(label);
+            if (it == nodes[current].children.end())
+            {
+                nodes.emplace_back();
+                it = nodes[current].children.emplace(std::string(label), nodes.size() - 1).first;
+            }
+            current = it->second;
+            return true;
+        });
+
+        if (wildcard)
+            nodes[current].subdomains = true;
+        else
+            nodes[current].exact = true;
+        return true;
+    }
+
+    // Extracts the lowercase host from an Origin header value like "https://Host:port/path".
+    static std::string ExtractHost(const std::string& origin)
+    {
+        size_t start = origin.find("://");
+        start = (start == std::string::npos) ? 0 : start + 3;
+
+        size_t end = origin.find_first_of(":/?#", start);
+        std::string host = origin.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+        return host;
+    }
+
+    bool Matches(const std::string& host) const
+    {
+        size_t current = 0;
+        bool matched = false;
+        ForEachLabel(host, [&](std::string_view label, bool last) {
+            // A wildcard above this label covers it as long as it is a subdomain.
+            if (nodes[current].subdomains)
+                matched = true;
+
+            auto it = nodes[current].children.find(label);
+            if (it == nodes[current].children.end())
+                return false;
+
+            current = it->second;
+            if (last && nodes[current].exact)
+                matched = true;
+            return true;
+        });
+        return matched;
+    }
+};
+
+// A fixed-size open-addressing table of sliding-window connection counters
+// keyed by short strings. Each window is split into BUCKETS time buckets
+// which are zeroed as they age out, so a count covers roughly the last
+// window seconds. If the probe range is full the entry with the lowest
+// count is replaced, keeping memory bounded however many keys are seen.
+class RateTable final
+{
+public:
+    static constexpr size_t KEY_SIZE = 64;
+    static constexpr size_t BUCKETS = 8;
+    static constexpr size_t MAX_PROBE = 8;
+
+private:
+    struct Slot final
+    {
+        uint32_t hash;
+        uint32_t total;
+        time_t epoch; // The bucket number that buckets[epoch % BUCKETS] holds.
+        uint32_t buckets[BUCKETS];
+        uint8_t keylen;
+        char key[KEY_SIZE];
+    };
+
+    std::vector<Slot> slots;
+    size_t mask = 0;
+    unsigned long bucket_length = 1;
+
+    static uint32_t Hash(std::string_view key)
+    {
+        // FNV-1a; zero is reserved for empty slots.
+        uint32_t hash = 2166136261u;
+        for (unsigned char c : key)
+            hash = (hash ^ c) * 16777619u;
+        return hash ? hash : 1;
+    }
+
+    static void Advance(Slot& slot, time_t epoch)
+    {
+        if (epoch <= slot.epoch)
+            return;
+
+        if (epoch - slot.epoch >= static_cast<time_t>(BUCKETS))
+        {
+            std::fill(std::begin(slot.buckets), std::end(slot.buckets), 0);
+            slot.total = 0;
+        }
+        else
+        {
+            for (time_t e = slot.epoch + 1; e <= epoch; ++e)
+            {
+                uint32_t& bucket = slot.buckets[e % BUCKETS];
+                slot.total -= bucket;
+                bucket = 0;
+            }
+        }
+        slot.epoch = epoch;
+    }
 
-    // Check if the WebSocket origin is allowed
-    bool IsAllowedOrigin(const std::string& origin)
+public:
+    void Configure(size_t size, unsigned long window)
+    {
+        size_t capacity = 64;
+        while (capacity < size)
+            capacity <<= 1;
+
+        slots.assign(capacity, Slot());
+        mask = capacity - 1;
+        bucket_length = std::max<unsigned long>(window / BUCKETS, 1);
+    }
+
+    // Records a connection for key and returns its count within the window.
+    uint32_t Hit(std::string_view key, time_t now)
+    {
+        if (slots.empty())
+            return 0;
+
+        key = key.substr(0, KEY_SIZE);
+        const uint32_t hash = Hash(key);
+        const time_t epoch = now / bucket_length;
+
+        Slot* victim = nullptr;
+        for (size_t probe = 0; probe < MAX_PROBE; ++probe)
+        {
+            Slot& slot = slots[(hash + probe) & mask];
+            if (slot.hash == hash && slot.keylen == key.length() && !memcmp(slot.key, key.data(), key.length()))
+            {
+                Advance(slot, epoch);
+                slot.buckets[epoch % BUCKETS]++;
+                return ++slot.total;
+            }
+
+            if (slot.hash)
+                Advance(slot, epoch);
+            if (!victim || !slot.hash || slot.total < victim->total)
+                victim = &slot;
+            if (!slot.hash)
+                break;
+        }
+
+        *victim = Slot();
+        victim->hash = hash;
+        victim->epoch = epoch;
+        victim->keylen = key.length();
+        memcpy(victim->key, key.data(), key.length());
+        victim->buckets[epoch % BUCKETS] = 1;
+        victim->total = 1;
+        return 1;
+    }
+
+    // Returns up to count keys with the highest counts in the current window.
+    std::vector<std::pair<std::string, uint32_t>> Top(size_t count, time_t now)
     {
-        for (const auto& allowed_origin : allowed_origins)
+        const time_t epoch = now / bucket_length;
+        std::vector<std::pair<std::string, uint32_t>> entries;
+        for (auto& slot : slots)
         {
-            if (origin.find(allowed_origin) != std::string::npos)
-                return true; // Allowed
+            if (!slot.hash)
+                continue;
+
+            Advance(slot, epoch);
+            if (slot.total)
+                entries.emplace_back(std::string(slot.key, slot.keylen), slot.total);
         }
-        return false; // Not allowed
+
+        const size_t shown = std::min(count, entries.size());
+        std::partial_sort(entries.begin(), entries.begin() + shown, entries.end(),
+            [](const auto& a, const auto& b) { return a.second > b.second; });
+        entries.resize(shown);
+        return entries;
     }
+};
+
+class ModuleDetectFakeWebSocket;
+
+// Applies queued Z-lines and sends warning summaries once per tick.
+class DetectionTimer final : public Timer
+{
+private:
+    ModuleDetectFakeWebSocket* mod;
+
+public:
+    DetectionTimer(ModuleDetectFakeWebSocket* m)
+        : Timer(1, true)
+        , mod(m)
+    {
+    }
+
+    bool Tick() override;
+};
+
+class ModuleDetectFakeWebSocket final
+    : public Module, public Stats::EventListener
+{
+private:
+    int websocket_port;
+    OriginMatcher allowed_origins;
+    unsigned long zline_duration;
+    std::string zline_reason;
+    char snomask;
+    unsigned long warn_interval;
+
+    // Connection rates per origin host and per source prefix.
+    RateTable origin_rates;
+    RateTable prefix_rates;
+    unsigned long rate_window = 0;
+    size_t table_size = 0;
+    unsigned long prefix_limit;
+    unsigned long origin_limit;
+    unsigned char ipv4_prefix;
+    unsigned char ipv6_prefix;
+    char stats_symbol;
+
+    // Reference to the existing WebSocket Origin extension from m_websocket.cpp
+    StringExtItem* websocket_origin;
+
+    // Addresses detected since the last tick which still need a Z-line.
+    std::vector<std::string> pending_zlines;
+    std::unordered_set<std::string> pending_ips;
+
+    // Detections which have not been announced yet because of warninterval.
+    unsigned long suppressed_warnings = 0;
+    time_t last_warning = 0;
+    std::string last_detection;
+
+    DetectionTimer timer;
+    Latency::Monitor latency;
+    Latency::Histogram& register_latency;
 
     // Extract the actual WebSocket Origin from m_websocket.cpp
     std::string GetUserWebSocketOrigin(LocalUser* user)
@@ -57,29 +337,90 @@ private:
         return origin ? *origin : "Unknown-Origin"; // Return WebSocket origin or default
     }
 
+    void WarnOpers(const std::string& detection)
+    {
+        const time_t now = ServerInstance->Time();
+        if (now - last_warning >= static_cast<time_t>(warn_interval))
+        {
+            last_warning = now;
+            ServerInstance->SNO.WriteToSnoMask(snomask, "WARNING: Botnet detected! {}! Applying Z-line.", detection);
+            return;
+        }
+
+        // Too soon after the last warning; this is included in the next summary.
+        suppressed_warnings++;
+        last_detection = detection;
+    }
+
+    void QueueZLine(const std::string& mask)
+    {
+        // The Z-line is added on the next tick together with any others
+        // so that the user list is only rescanned once.
+        if (pending_ips.insert(mask).second)
+            pending_zlines.push_back(mask);
+    }
+
 public:
     ModuleDetectFakeWebSocket()
         : Module(VF_VENDOR, "Detects and Z-lines botnets faking WebSocket connections."),
-          websocket_origin(nullptr) // Initialize the extension as nullptr
+          Stats::EventListener(this),
+          websocket_origin(nullptr), // Initialize the extension as nullptr
+          timer(this),
+          latency(this, "detect_fake_websocket"),
+          register_latency(latency.Add("OnUserRegister"))
     {
+        ServerInstance->Timers.AddTimer(&timer);
+    }
+
+    ~ModuleDetectFakeWebSocket() override
+    {
+        ServerInstance->Timers.DelTimer(&timer);
     }
 
     void ReadConfig(ConfigStatus& status) override
     {
+        latency.ReadConfig();
+
         const auto& tag = ServerInstance->Config->ConfValue("detectfakewebsocket");
 
         websocket_port = tag->getNum<int>("port", 8083);
-        zline_duration = tag->getNum<int>("zline_duration", 3600);
+        zline_duration = tag->getDuration("zline_duration", 3600);
         zline_reason = tag->getString("zline_reason", "Botnet detected using WebSockets!");
+        warn_interval = tag->getDuration("warninterval", 10);
+
+        std::string mask = tag->getString("snomask", "a");
+        snomask = mask.empty() ? 'a' : mask[0];
+        if (snomask < 'a' || snomask > 'z')
+            snomask = 'a';
+
+        const unsigned long newwindow = tag->getDuration("window", 60, 1);
+        const size_t newtablesize = tag->getNum<size_t>("tablesize", 4096, 64, 1048576);
+        prefix_limit = tag->getNum<unsigned long>("prefixlimit", 0);
+        origin_limit = tag->getNum<unsigned long>("originlimit", 0);
+        ipv4_prefix = tag->getNum<unsigned char>("ipv4prefix", 24, 8, 32);
+        ipv6_prefix = tag->getNum<unsigned char>("ipv6prefix", 64, 16, 128);
+
+        std::string symbol = tag->getString("statssymbol", "W", 1, 1);
+        stats_symbol = symbol[0];
+
+        // Resizing discards the current counts so only do it when needed.
+        if (newwindow != rate_window || newtablesize != table_size)
+        {
+            rate_window = newwindow;
+            table_size = newtablesize;
+            origin_rates.Configure(table_size, rate_window);
+            prefix_rates.Configure(table_size, rate_window);
+        }
 
         // Read and split multiple allowed origins
-        std::string origins = tag->getString("origin", "kiwiirc.com");
-        allowed_origins.clear();
+        std::string origins = tag->getString("origin", "kiwiirc.com,*.kiwiirc.com");
+        OriginMatcher matcher;
         irc::commasepstream originstream(origins);
         std::string origin;
         while (originstream.GetToken(origin))
         {
-            allowed_origins.push_back(origin);
+            if (!matcher.Add(origin))
+                throw ModuleException(this, "Invalid origin '" + origin + "' in <detectfakewebsocket:origin> at " + tag->source.str());
         }
 
         // Get the existing WebSocket origin extension from m_websocket.cpp
@@ -89,9 +430,9 @@ public:
             throw ModuleException(this, "Could not find websocket-origin extension. Is m_websocket loaded?");
         }
 
-        ServerInstance->Logs.Normal("m_detect_fake_websocket",
-            "Loaded config: WebSockets port = %d, Allowed origins = %s, Z-line = %d seconds",
-            websocket_port, origins.c_str(), zline_duration);
+        allowed_origins = std::move(matcher);
+        ServerInstance->Logs.Normal(MODNAME, "Loaded config: WebSockets port = {}, Allowed origins = {}, Z-line = {} seconds",
+            websocket_port, origins, zline_duration);
     }
 
     void Prioritize() override
@@ -101,42 +442,109 @@ public:
 
     ModResult OnUserRegister(LocalUser* user) override
     {
+        Latency::ScopedTimer latencytimer(register_latency);
         if (user->server_sa.port() == websocket_port)
         {
             std::string real_origin = GetUserWebSocketOrigin(user); // Extract real WebSocket Origin
+            const std::string host = OriginMatcher::ExtractHost(real_origin);
+            const time_t now = ServerInstance->Time();
+            const std::string client_ip = user->GetAddress();
 
-            if (!IsAllowedOrigin(real_origin))
+            // Too many connections from one subnet; Z-line all of it at once.
+            if (user->client_sa.is_ip())
             {
-                std::string client_ip = user->GetAddress();
-
-                ServerInstance->Logs.Normal("m_detect_fake_websocket",
-                    "Botnet detected! %s is using WebSockets port %d with origin (%s)! Applying Z-line...",
-                    client_ip.c_str(), websocket_port, real_origin.c_str());
-
-                for (LocalUser* u : ServerInstance->Users.GetLocalUsers())
+                const unsigned char range = user->client_sa.family() == AF_INET ? ipv4_prefix : ipv6_prefix;
+                const std::string prefix = irc::sockets::cidr_mask(user->client_sa, range).str();
+                const uint32_t count = prefix_rates.Hit(prefix, now);
+                if (prefix_limit && count > prefix_limit)
                 {
-                    if (u->IsOper())
-                    {
-                        u->WriteNotice(INSP_FORMAT(
-                            "WARNING: Botnet detected! {} is using WebSockets port {} with origin ({})! Applying Z-line.",
-                            client_ip, websocket_port, real_origin));
-                    }
+                    ServerInstance->Logs.Debug(MODNAME, "Connection flood from {} ({} connections in {})! Applying Z-line...",
+                        prefix, count, Duration::ToString(rate_window));
+                    WarnOpers(INSP_FORMAT("{} connections from {} on WebSockets port {} in {}", count, prefix, websocket_port, Duration::ToString(rate_window)));
+                    QueueZLine(prefix);
+                    ServerInstance->Users.QuitUser(user, zline_reason);
+                    return MOD_RES_DENY;
                 }
+            }
 
-                // Apply a Z-line ban
-                ZLine* zl = new ZLine(ServerInstance->Time(), zline_duration, "FakeWebSocket", zline_reason, client_ip);
-                if (ServerInstance->XLines->AddLine(zl, nullptr))
-                {
-                    ServerInstance->XLines->ApplyLines();
-                }
+            const uint32_t origin_count = origin_rates.Hit(host.empty() ? real_origin : host, now);
+            const bool origin_flood = origin_limit && origin_count > origin_limit;
+            if (origin_flood || !allowed_origins.Matches(host))
+            {
+                ServerInstance->Logs.Debug(MODNAME, "Botnet detected! {} is using WebSockets port {} with origin ({})! Applying Z-line...",
+                    client_ip, websocket_port, real_origin);
+                if (origin_flood)
+                    WarnOpers(INSP_FORMAT("{} is using WebSockets port {} with origin ({}), which had {} connections in {}", client_ip, websocket_port,
+                        real_origin, origin_count, Duration::ToString(rate_window)));
+                else
+                    WarnOpers(INSP_FORMAT("{} is using WebSockets port {} with origin ({})", client_ip, websocket_port, real_origin));
+
+                QueueZLine(client_ip);
 
                 //  Disconnect the user immediately
                 ServerInstance->Users.QuitUser(user, zline_reason);
+                return MOD_RES_DENY;
             }
         }
 
         return MOD_RES_PASSTHRU;
     }
+
+    void OnTick()
+    {
+        if (!pending_zlines.empty())
+        {
+            bool added = false;
+            for (const auto& ip : pending_zlines)
+            {
+                ZLine* zl = new ZLine(ServerInstance->Time(), zline_duration, "FakeWebSocket", zline_reason, ip);
+                if (ServerInstance->XLines->AddLine(zl, nullptr))
+                    added = true;
+                else
+                    delete zl;
+            }
+
+            ServerInstance->Logs.Normal(MODNAME, "Added {} Z-line(s) for fake WebSocket connections", pending_zlines.size());
+            pending_zlines.clear();
+            pending_ips.clear();
+
+            if (added)
+                ServerInstance->XLines->ApplyLines();
+        }
+
+        if (suppressed_warnings && ServerInstance->Time() - last_warning >= static_cast<time_t>(warn_interval))
+        {
+            ServerInstance->SNO.WriteToSnoMask(snomask, "WARNING: {} more botnet detection(s) on WebSockets port {} in the last {} (most recent: {}).",
+                suppressed_warnings, websocket_port, Duration::ToString(ServerInstance->Time() - last_warning), last_detection);
+            suppressed_warnings = 0;
+            last_warning = ServerInstance->Time();
+        }
+    }
+
+    ModResult OnStats(Stats::Context& stats) override
+    {
+        if (stats.GetSymbol() != stats_symbol)
+            return MOD_RES_PASSTHRU;
+
+        const time_t now = ServerInstance->Time();
+        stats.AddRow(998, INSP_FORMAT("WebSocket connections in the last {}:", Duration::ToString(rate_window)));
+
+        stats.AddRow(998, "  Top origins:");
+        for (const auto& [origin, count] : origin_rates.Top(10, now))
+            stats.AddRow(998, INSP_FORMAT("    {}: {}", origin, count));
+
+        stats.AddRow(998, "  Top source prefixes:");
+        for (const auto& [prefix, count] : prefix_rates.Top(10, now))
+            stats.AddRow(998, INSP_FORMAT("    {}: {}", prefix, count));
+
+        return MOD_RES_DENY;
+    }
 };
 
+bool DetectionTimer::Tick()
+{
+    mod->OnTick();
+    return true;
+}
+
 MODULE_INIT(ModuleDetectFakeWebSocket)
@@ -18,7 +18,7 @@
 
 /// $ModAuthor: reverse <mike.chevronnet@gmail.com>
 /// $ModDesc: Adds city and country information to WHOIS using the MaxMind database and it's usermode +y.
-/// $ModConfig: <geolite dbpath="path/geodata/GeoLite2-City.mmdb">
+/// $ModConfig: <geolite dbpath="path/geodata/GeoLite2-City.mmdb" cachesize="4096" reloadinterval="1h">
 /// $ModDepends: core 4
 
 /// $LinkerFlags: -lmaxminddb
@@ -26,7 +26,15 @@
 #include "inspircd.h"
 #include "modules/whois.h"
 #include "extension.h"
+#include "threadengine.h"
+#include "whoisextras.h"
+#include "hooklatency.h"
 #include <maxminddb.h>
+#include <sys/stat.h>
+#include <array>
+#include <list>
+#include <memory>
+#include <unordered_map>
 
 class GeoLiteMode final : public SimpleUserMode
 {
@@ -37,32 +45,503 @@ public:
     }
 };
 
+// Pool of interned location strings. Users and cache entries hold a
+// reference to an entry instead of their own copy of the string.
+class LocationPool final
+{
+public:
+    struct Entry
+    {
+        const std::string text;
+        size_t refs = 0;
+
+        explicit Entry(const std::string& t)
+            : text(t)
+        {
+        }
+    };
+
+private:
+    std::unordered_map<std::string, Entry> entries;
+
+public:
+    // Returns the entry for text with a reference taken on it.
+    Entry* Acquire(const std::string& text)
+    {
+        Entry& entry = entries.try_emplace(text, text).first->second;
+        entry.refs++;
+        return &entry;
+    }
+
+    void AddRef(Entry* entry)
+    {
+        entry->refs++;
+    }
+
+    void Release(Entry* entry)
+    {
+        if (!--entry->refs)
+            entries.erase(entry->text);
+    }
+
+    size_t Size() const
+    {
+        return entries.size();
+    }
+};
+
+// Extension item which stores a reference to an interned location string
+// and syncs the text across the network.
+class LocationExtItem final : public ExtensionItem
+{
+private:
+    LocationPool& pool;
+
+    void Replace(User* user, LocationPool::Entry* entry)
+    {
+        void* old = entry ? SetRaw(user, entry) : UnsetRaw(user);
+        if (old)
+            pool.Release(static_cast<LocationPool::Entry*>(old));
+    }
+
+public:
+    LocationExtItem(Module* mod, LocationPool& p)
+        : ExtensionItem(mod, "geo-lite-country", ExtensionType::USER)
+        , pool(p)
+    {
+    }
+
+    const std::string* Get(const User* user) const
+    {
+        const auto* entry = static_cast<const LocationPool::Entry*>(GetRaw(user));
+        return entry ? &entry->text : nullptr;
+    }
+
+    // Sets the location of a user, taking another reference on the entry.
+    void Set(User* user, LocationPool::Entry* entry)
+    {
+        if (GetRaw(user) == entry)
+            return;
+
+        pool.AddRef(entry);
+        Replace(user, entry);
+        Sync(user, entry);
+    }
+
+    void Unset(User* user)
+    {
+        if (!GetRaw(user))
+            return;
+
+        Replace(user, nullptr);
+        Sync(user, nullptr);
+    }
+
+    void FromNetwork(Extensible* container, const std::string& value) noexcept override
+    {
+        // Already synced; replace without sending it back out.
+        User* user = static_cast<User*>(container);
+        Replace(user, value.empty() ? nullptr : pool.Acquire(value));
+    }
+
+    std::string ToNetwork(const Extensible* container, void* item) const noexcept override
+    {
+        return static_cast<LocationPool::Entry*>(item)->text;
+    }
+
+    void Delete(Extensible* container, void* item) override
+    {
+        pool.Release(static_cast<LocationPool::Entry*>(item));
+    }
+};
+
+// LRU of lookup results keyed on the network prefix which the database
+// returned for them. Every address in a prefix shares the same record, so a
+// reconnect storm from one provider is answered without touching the
+// database. Prefixes in the database never overlap, so at most one cached
+// prefix can contain a given address.
+class LocationCache final
+{
+public:
+    // Addresses are kept in the IPv6 address space with IPv4 mapped to
+    // ::/96 the way the MaxMind database stores them.
+    struct Prefix
+    {
+        std::array<uint8_t, 16> bytes = { };
+        uint8_t length = 0;
+
+        bool operator==(const Prefix& other) const
+        {
+            return length == other.length && bytes == other.bytes;
+        }
+
+        // Returns this address truncated to the given prefix length.
+        Prefix Truncate(uint8_t newlength) const
+        {
+            Prefix prefix;
+            prefix.length = newlength;
+            const size_t full = newlength / 8;
+            std::copy_n(bytes.begin(), full, prefix.bytes.begin());
+            if (newlength % 8)
+                prefix.bytes[full] = bytes[full] & static_cast<uint8_t>(0xFF << (8 - newlength % 8));
+            return prefix;
+        }
+    };
+
+    struct PrefixHash
+    {
+        size_t operator()(const Prefix& prefix) const
+        {
+            // FNV-1a over the prefix.
+            uint64_t hash = 0xcbf29ce484222325ULL;
+            for (uint8_t byte : prefix.bytes)
+                hash = (hash ^ byte) * 0x100000001b3ULL;
+            return (hash ^ prefix.length) * 0x100000001b3ULL;
+        }
+    };
+
+private:
+    // A null location means the database has no record for the prefix.
+    using List = std::list<std::pair<Prefix, LocationPool::Entry*>>;
+
+    LocationPool& pool;
+    List entries;
+    std::unordered_map<Prefix, List::iterator, PrefixHash> index;
+
+    // How many cached prefixes there are of each length so lookups only
+    // probe the lengths which are present.
+    std::array<size_t, 129> lengths = { };
+    size_t capacity = 0;
+
+    void Evict(List::iterator it)
+    {
+        lengths[it->first.length]--;
+        if (it->second)
+            pool.Release(it->second);
+        index.erase(it->first);
+        entries.erase(it);
+    }
+
+public:
+    LocationCache(LocationPool& p)
+        : pool(p)
+    {
+    }
+
+    ~LocationCache()
+    {
+        Clear();
+    }
+
+    void SetCapacity(size_t newcapacity)
+    {
+        capacity = newcapacity;
+        while (entries.size() > capacity)
+            Evict(std::prev(entries.end()));
+    }
+
+    // Looks up the prefix containing address. Returns false on a miss;
+    // otherwise location is set, possibly to nullptr for a known unknown.
+    bool Find(const Prefix& address, LocationPool::Entry*& location)
+    {
+        if (entries.empty())
+            return false;
+
+        for (size_t length = lengths.size(); length-- > 0; )
+        {
+            if (!lengths[length])
+                continue;
+
+            auto it = index.find(address.Truncate(static_cast<uint8_t>(length)));
+            if (it == index.end())
+                continue;
+
+            entries.splice(entries.begin(), entries, it->second);
+            location = it->second->second;
+            return true;
+        }
+        return false;
+    }
+
+    void Store(const Prefix& prefix, LocationPool::Entry* location)
+    {
+        if (!capacity || index.count(prefix))
+            return;
+
+        if (entries.size() >= capacity)
+            Evict(std::prev(entries.end()));
+
+        if (location)
+            pool.AddRef(location);
+        entries.emplace_front(prefix, location);
+        index.emplace(prefix, entries.begin());
+        lengths[prefix.length]++;
+    }
+
+    void Clear()
+    {
+        while (!entries.empty())
+            Evict(std::prev(entries.end()));
+    }
+
+    size_t Size() const
+    {
+        return entries.size();
+    }
+};
+
+// An open MaxMind database. Handles are shared so that replacing the
+// database never closes one which is still being used.
+class GeoDatabase final
+{
+public:
+    MMDB_s mmdb;
+    const std::string path;
+    const time_t mtime;
+
+    GeoDatabase(const std::string& p, time_t mt)
+        : path(p)
+        , mtime(mt)
+    {
+    }
+
+    ~GeoDatabase()
+    {
+        MMDB_close(&mmdb);
+    }
+
+    // Opens and sanity checks a database. Returns nullptr and sets error on
+    // failure. This only touches the new database so it can run on any thread.
+    static std::shared_ptr<GeoDatabase> Open(const std::string& path, std::string& error)
+    {
+        struct stat sb;
+        if (stat(path.c_str(), &sb) != 0) {
+            error = "Unable to stat " + path + ": " + strerror(errno);
+            return nullptr;
+        }
+
+        auto database = std::make_shared<GeoDatabase>(path, sb.st_mtime);
+        int status_open = MMDB_open(path.c_str(), MMDB_MODE_MMAP, &database->mmdb);
+        if (status_open != MMDB_SUCCESS) {
+            // MMDB_open cleans up after itself on failure.
+            database->mmdb = MMDB_s();
+            error = "Failed to open GeoLite2 database: " + std::string(MMDB_strerror(status_open));
+            return nullptr;
+        }
+
+        const MMDB_metadata_s& metadata = database->mmdb.metadata;
+        if ((metadata.ip_version != 4 && metadata.ip_version != 6) || !metadata.node_count) {
+            error = "GeoLite2 database " + path + " has invalid metadata";
+            return nullptr;
+        }
+
+        return database;
+    }
+};
+
+class ModuleWhoisGeoLite;
+
+// Opens a replacement database off the main thread.
+class DatabaseLoader final : public SocketThread
+{
+private:
+    ModuleWhoisGeoLite* const mod;
+
+public:
+    const std::string path;
+    std::shared_ptr<GeoDatabase> database;
+    std::string error;
+    bool finished = false;
+
+    DatabaseLoader(ModuleWhoisGeoLite* m, const std::string& p)
+        : mod(m)
+        , path(p)
+    {
+    }
+
+    void OnStart() override
+    {
+        std::string newerror;
+        std::shared_ptr<GeoDatabase> newdatabase = GeoDatabase::Open(path, newerror);
+
+        LockQueue();
+        database = std::move(newdatabase);
+        error = std::move(newerror);
+        UnlockQueue();
+        NotifyParent();
+    }
+
+    void OnNotify() override;
+};
+
+// Periodically checks whether the database file has been updated.
+class ReloadTimer final : public Timer
+{
+private:
+    ModuleWhoisGeoLite* const mod;
+
+public:
+    ReloadTimer(ModuleWhoisGeoLite* m, unsigned long interval)
+        : Timer(interval, true)
+        , mod(m)
+    {
+    }
+
+    bool Tick() override;
+};
+
 class ModuleWhoisGeoLite final : public Module, public Whois::EventListener
 {
 private:
-    MMDB_s mmdb;                 // MaxMind database object
+    std::shared_ptr<GeoDatabase> database;  // MaxMind database handle
+    std::unique_ptr<DatabaseLoader> loader;  // Background reload, if any
+    std::unique_ptr<ReloadTimer> reload_timer;
     std::string dbpath;          // Path to the GeoLite2 database
-    StringExtItem country_item;  // Extension item for storing city and country info
+    LocationPool locations;      // Interned "City: X, Country: Y" strings
+    LocationCache cache;         // Lookup results keyed on database prefix
+    LocationExtItem country_item;  // Extension item for storing city and country info
+    WhoisExtras::Cache whois_cache;  // Formatted WHOIS line
     GeoLiteMode geolite_mode;    // User mode +y for controlling geolocation visibility
+    Latency::Monitor latency;    // Hook timings for /STATS
+    Latency::Histogram& address_latency;
+
+    // Look the location of an address up in the database.
+    LocationPool::Entry* Lookup(const sockaddr* addr, LocationCache::Prefix& prefix)
+    {
+        // Keep the database alive for the duration of the lookup.
+        const std::shared_ptr<GeoDatabase> db = database;
+        if (!db)
+        {
+            prefix.length = 0;
+            return nullptr;
+        }
+
+        const MMDB_s& mmdb = db->mmdb;
+        int gai_error = 0;
+        MMDB_lookup_result_s result = MMDB_lookup_sockaddr(&mmdb, addr, &gai_error);
+        if (gai_error != 0)
+        {
+            prefix.length = 0;
+            return nullptr;
+        }
+
+        // An IPv4 database reports prefix lengths in the IPv4 address space.
+        const unsigned int offset = (addr->sa_family == AF_INET && mmdb.metadata.ip_version == 4) ? 96 : 0;
+        prefix = prefix.Truncate(static_cast<uint8_t>(std::min(result.netmask + offset, 128U)));
+
+        if (!result.found_entry)
+            return nullptr;
+
+        MMDB_entry_data_s city_data = {};
+        MMDB_entry_data_s country_data = {};
+        int status_city = MMDB_get_value(&result.entry, &city_data, "city", "names", "en", nullptr);
+        int status_country = MMDB_get_value(&result.entry, &country_data, "country", "names", "en", nullptr);
+
+        std::string city = (status_city == MMDB_SUCCESS && city_data.has_data) ? std::string(city_data.utf8_string, city_data.data_size) : "Unknown";
+        std::string country = (status_country == MMDB_SUCCESS && country_data.has_data) ? std::string(country_data.utf8_string, country_data.data_size) : "Unknown";
+
+        return locations.Acquire("City: " + city + ", Country: " + country);
+    }
+
+    void CleanupLoader(bool force)
+    {
+        if (loader && (force || loader->finished))
+        {
+            // This waits for a running load to finish.
+            loader->Stop();
+            loader.reset();
+        }
+    }
+
+    // Replaces the database. Results cached from the old one are dropped;
+    // the old mapping is closed once nothing refers to it any more.
+    void SwapDatabase(std::shared_ptr<GeoDatabase> newdatabase)
+    {
+        database = std::move(newdatabase);
+        cache.Clear();
+    }
 
 public:
     ModuleWhoisGeoLite()
         : Module(VF_OPTCOMMON, "Adds city and country information to WHOIS using the MaxMind database.")
         , Whois::EventListener(this)
-        , country_item(this, "geo-lite-country", ExtensionType::USER, true) // Sync across servers
+        , cache(locations)
+        , country_item(this, locations) // Sync across servers
+        , whois_cache(this, WhoisExtras::GEOLOCATION)
         , geolite_mode(this)
+        , latency(this, "geomaxlite")
+        , address_latency(latency.Add("OnChangeRemoteAddress"))
     {
     }
 
+    // Starts reloading the database in the background if the file has
+    // changed since it was opened.
+    void CheckForUpdate()
+    {
+        CleanupLoader(false);
+        if (loader || !database)
+            return;
+
+        struct stat sb;
+        if (stat(dbpath.c_str(), &sb) != 0 || sb.st_mtime == database->mtime)
+            return;
+
+        loader = std::make_unique<DatabaseLoader>(this, dbpath);
+        loader->Start();
+    }
+
+    void OnDatabaseLoaded(DatabaseLoader* done)
+    {
+        done->finished = true;
+
+        // The path may have changed in a rehash while we were loading.
+        if (done->path != dbpath)
+            return;
+
+        if (!done->database) {
+            ServerInstance->SNO.WriteGlobalSno('a', "GeoLite2: Unable to reload the database, still using the old one: " + done->error);
+            return;
+        }
+
+        SwapDatabase(std::move(done->database));
+        ServerInstance->SNO.WriteGlobalSno('a', "GeoLite2: Reloaded the database from " + dbpath);
+    }
+
     void ReadConfig(ConfigStatus& status) override
     {
+        latency.ReadConfig();
+
         auto& tag = ServerInstance->Config->ConfValue("geolite");
-        dbpath = ServerInstance->Config->Paths.PrependConfig(tag->getString("dbpath", "data/GeoLite2-City.mmdb"));
+        const std::string newdbpath = ServerInstance->Config->Paths.PrependConfig(tag->getString("dbpath", "data/GeoLite2-City.mmdb"));
+        cache.SetCapacity(tag->getNum<size_t>("cachesize", 4096, 0, 1000000));
+        const unsigned long reload_interval = tag->getDuration("reloadinterval", 3600);
 
-        int status_open = MMDB_open(dbpath.c_str(), MMDB_MODE_MMAP, &mmdb);
-        if (status_open != MMDB_SUCCESS) {
-            std::string error_msg = "GeoLite2: Failed to open GeoLite2 database: " + std::string(MMDB_strerror(status_open));
-            throw ModuleException(this, error_msg.c_str());
+        // Only reopen the database if it is a different file or it changed;
+        // otherwise keep using the one that is already mapped.
+        struct stat sb;
+        const bool changed = !database || newdbpath != database->path
+            || stat(newdbpath.c_str(), &sb) != 0 || sb.st_mtime != database->mtime;
+        if (changed) {
+            std::string error;
+            std::shared_ptr<GeoDatabase> newdatabase = GeoDatabase::Open(newdbpath, error);
+            if (!newdatabase)
+                throw ModuleException(this, "GeoLite2: " + error);
+
+            CleanupLoader(true);
+            SwapDatabase(std::move(newdatabase));
+        }
+        dbpath = newdbpath;
+
+        if (reload_interval) {
+            if (!reload_timer) {
+                reload_timer = std::make_unique<ReloadTimer>(this, reload_interval);
+                ServerInstance->Timers.AddTimer(reload_timer.get());
+            } else {
+                reload_timer->SetInterval(reload_interval);
+            }
+        } else if (reload_timer) {
+            ServerInstance->Timers.DelTimer(reload_timer.get());
+            reload_timer.reset();
         }
     }
 
@@ -76,7 +555,9 @@ public:
 
         const std::string* info = country_item.Get(target);
         if (info && !info->empty()) {
-            whois.SendLine(RPL_WHOISSPECIAL, "is connecting from " + *info);
+            whois.SendLine(RPL_WHOISSPECIAL, whois_cache.Get(target, *info, [](const std::string& location) {
+                return "is connecting from " + location;
+            }));
         } else {
             whois.SendLine(RPL_WHOISSPECIAL, "City: Unknown, Country: Unknown");
         }
@@ -84,29 +565,47 @@ public:
 
     void OnChangeRemoteAddress(LocalUser* user) override
     {
+        Latency::ScopedTimer latencytimer(address_latency);
+        whois_cache.Invalidate(user);
+
         if (!user->client_sa.is_ip()) {
             country_item.Unset(user);
             return;
         }
 
-        int gai_error = 0;
-        const struct sockaddr* addr = &user->client_sa.sa;
-        MMDB_lookup_result_s result = MMDB_lookup_sockaddr(&mmdb, addr, &gai_error);
-
-        if (gai_error != 0 || !result.found_entry) {
-            country_item.Unset(user);
-            return;
+        LocationCache::Prefix address;
+        if (user->client_sa.family() == AF_INET6)
+        {
+            std::copy_n(user->client_sa.in6.sin6_addr.s6_addr, 16, address.bytes.begin());
+        }
+        else
+        {
+            const auto* in4 = reinterpret_cast<const uint8_t*>(&user->client_sa.in4.sin_addr);
+            std::copy_n(in4, 4, address.bytes.begin() + 12);
         }
+        address.length = 128;
 
-        MMDB_entry_data_s city_data = {};
-        MMDB_entry_data_s country_data = {};
-        int status_city = MMDB_get_value(&result.entry, &city_data, "city", "names", "en", nullptr);
-        int status_country = MMDB_get_value(&result.entry, &country_data, "country", "names", "en", nullptr);
+        LocationPool::Entry* location = nullptr;
+        if (!cache.Find(address, location))
+        {
+            LocationCache::Prefix prefix = address;
+            location = Lookup(&user->client_sa.sa, prefix);
+            if (prefix.length)
+                cache.Store(prefix, location);
 
-        std::string city = (status_city == MMDB_SUCCESS && city_data.has_data) ? std::string(city_data.utf8_string, city_data.data_size) : "Unknown";
-        std::string country = (status_country == MMDB_SUCCESS && country_data.has_data) ? std::string(country_data.utf8_string, country_data.data_size) : "Unknown";
+            // Drop the reference taken by the lookup once the user has theirs.
+            if (location)
+            {
+                country_item.Set(user, location);
+                locations.Release(location);
+                return;
+            }
+        }
 
-        country_item.Set(user, "City: " + city + ", Country: " + country);
+        if (location)
+            country_item.Set(user, location);
+        else
+            country_item.Unset(user);
     }
 
     void OnUserQuit(User* user, const std::string& message, const std::string& opermessage) override
@@ -117,8 +616,22 @@ public:
 
     ~ModuleWhoisGeoLite() override
     {
-        MMDB_close(&mmdb);
+        if (reload_timer)
+            ServerInstance->Timers.DelTimer(reload_timer.get());
+        CleanupLoader(true);
+        cache.Clear();
     }
 };
 
+void DatabaseLoader::OnNotify()
+{
+    mod->OnDatabaseLoaded(this);
+}
+
+bool ReloadTimer::Tick()
+{
+    mod->CheckForUpdate();
+    return true;
+}
+
 MODULE_INIT(ModuleWhoisGeoLite)
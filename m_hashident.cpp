@@ -18,91 +18,213 @@
 
 /// $ModAuthor: Jean Chevronnet (reverse) <mike.chevronnet@gmail.com>
 /// $ModDesc: Sets the user's ident to HMAC-SHA256 hash of their IP address + SECRET_KEY
+/// $ModConfig: <hashident key="..." cachesize="4096">
 /// $ModDepends: core 4
 
+/// $LinkerFlags: -lcrypto
+
 #include "inspircd.h"
 #include "users.h"
-#include "modules/hash.h"
-#include <iomanip>
-#include <sstream>
+#include "hooklatency.h"
+#include <openssl/evp.h>
 #include <arpa/inet.h>
+#include <cstring>
 
-class ModuleHashIdent : public Module
+/** HMAC-SHA256 with the key schedule computed once.
+ * The inner and outer hash states are keyed when the secret is set; each
+ * hash then only copies those states and absorbs the message.
+ */
+class KeyedHash final
 {
 private:
-	dynamic_reference_nocheck<HashProvider> sha256;
-	std::string secret_key;
+	static constexpr size_t BLOCK_SIZE = 64;
+
+	EVP_MD_CTX* inner = nullptr;
+	EVP_MD_CTX* outer = nullptr;
+	EVP_MD_CTX* work = nullptr;
 
 public:
-	ModuleHashIdent()
-		: Module(VF_VENDOR, "Sets the user's ident to a 12-character HMAC-SHA256 hash of their IP address. Supports UNIX socket connections."),
-		  sha256(this, "hash/sha256")
+	static constexpr size_t DIGEST_SIZE = 32;
+
+	KeyedHash()
+		: inner(EVP_MD_CTX_new())
+		, outer(EVP_MD_CTX_new())
+		, work(EVP_MD_CTX_new())
 	{
 	}
 
-	/** Read secret key from config **/
-	void ReadConfig(ConfigStatus&) override
+	~KeyedHash()
 	{
-		std::shared_ptr<ConfigTag> tag = ServerInstance->Config->ConfValue("hashident");
-		secret_key = tag->getString("key");
+		EVP_MD_CTX_free(inner);
+		EVP_MD_CTX_free(outer);
+		EVP_MD_CTX_free(work);
+	}
 
-		// If key is missing or empty, throw a config error
-		if (secret_key.empty())
+	bool SetKey(const std::string& key)
+	{
+		if (!inner || !outer || !work)
+			return false;
+
+		// Keys longer than a block are replaced by their digest (RFC 2104).
+		unsigned char block[BLOCK_SIZE] = { 0 };
+		if (key.length() > BLOCK_SIZE)
 		{
-			throw ModuleException(this, "Missing required <hashident key=\"...\"> configuration in modules.conf!");
+			unsigned int len = 0;
+			if (!EVP_Digest(key.data(), key.length(), block, &len, EVP_sha256(), nullptr))
+				return false;
 		}
+		else
+			memcpy(block, key.data(), key.length());
+
+		unsigned char ipad[BLOCK_SIZE];
+		unsigned char opad[BLOCK_SIZE];
+		for (size_t i = 0; i < BLOCK_SIZE; i++)
+		{
+			ipad[i] = block[i] ^ 0x36;
+			opad[i] = block[i] ^ 0x5c;
+		}
+
+		return EVP_DigestInit_ex(inner, EVP_sha256(), nullptr) && EVP_DigestUpdate(inner, ipad, BLOCK_SIZE)
+			&& EVP_DigestInit_ex(outer, EVP_sha256(), nullptr) && EVP_DigestUpdate(outer, opad, BLOCK_SIZE);
 	}
 
-	/** Normalize IP **/
-	std::string NormalizeIP(const irc::sockets::sockaddrs& addr)
+	bool Hash(const void* data, size_t length, unsigned char (&out)[DIGEST_SIZE])
 	{
-		char ipstr[INET6_ADDRSTRLEN];
+		unsigned int len = 0;
+		return EVP_MD_CTX_copy_ex(work, inner) && EVP_DigestUpdate(work, data, length) && EVP_DigestFinal_ex(work, out, &len)
+			&& EVP_MD_CTX_copy_ex(work, outer) && EVP_DigestUpdate(work, out, DIGEST_SIZE) && EVP_DigestFinal_ex(work, out, &len);
+	}
+};
+
+class ModuleHashIdent : public Module
+{
+private:
+	static constexpr size_t IDENT_LENGTH = 12;
+
+	/** A remembered address and the ident generated for it. */
+	struct CacheEntry final
+	{
+		// Address family followed by the raw address bytes.
+		unsigned char key[17];
+		char ident[IDENT_LENGTH + 1];
+		bool used;
+	};
+
+	KeyedHash hmac;
+	std::string secret_key;
 
-		if (addr.family() == AF_INET) // IPv4
+	// Direct-mapped: a colliding address simply replaces the previous one.
+	std::vector<CacheEntry> cache;
+
+	Latency::Monitor latency;
+	Latency::Histogram& connect_latency;
+
+	/** Writes the family and raw bytes of an IP address to key. Returns false for non-IP sockets. */
+	static bool GetAddressKey(const irc::sockets::sockaddrs& addr, unsigned char (&key)[17], size_t& length)
+	{
+		memset(key, 0, sizeof(key));
+		if (addr.family() == AF_INET)
 		{
-			if (inet_ntop(AF_INET, &addr.in4.sin_addr, ipstr, sizeof(ipstr)) == nullptr)
-				return "unknown";
+			key[0] = 4;
+			memcpy(key + 1, &addr.in4.sin_addr, 4);
+			length = 5;
+			return true;
 		}
-		else if (addr.family() == AF_INET6) // IPv6
+		if (addr.family() == AF_INET6)
 		{
-			if (inet_ntop(AF_INET6, &addr.in6.sin6_addr, ipstr, sizeof(ipstr)) == nullptr)
-				return "unknown";
+			key[0] = 6;
+			memcpy(key + 1, &addr.in6.sin6_addr, 16);
+			length = 17;
+			return true;
 		}
-		else if (addr.family() == AF_UNIX) // UNIX socket
+		return false;
+	}
+
+	CacheEntry* FindSlot(const unsigned char (&key)[17])
+	{
+		if (cache.empty())
+			return nullptr;
+
+		// FNV-1a over the address key.
+		uint32_t hash = 2166136261u;
+		for (unsigned char c : key)
+			hash = (hash ^ c) * 16777619u;
+		return &cache[hash % cache.size()];
+	}
+
+public:
+	ModuleHashIdent()
+		: Module(VF_VENDOR, "Sets the user's ident to a 12-character HMAC-SHA256 hash of their IP address. Supports UNIX socket connections.")
+		, latency(this, "hashident")
+		, connect_latency(latency.Add("OnUserConnect"))
+	{
+	}
+
+	/** Read secret key from config **/
+	void ReadConfig(ConfigStatus&) override
+	{
+		std::shared_ptr<ConfigTag> tag = ServerInstance->Config->ConfValue("hashident");
+		const std::string newkey = tag->getString("key");
+
+		// If key is missing or empty, throw a config error
+		if (newkey.empty())
 		{
-			return "unixsocket";
+			throw ModuleException(this, "Missing required <hashident key=\"...\"> configuration in modules.conf!");
 		}
-		else
+
+		const size_t cachesize = tag->getNum<size_t>("cachesize", 4096, 0, 1000000);
+		if (newkey != secret_key || cachesize != cache.size())
 		{
-			return "unknown"; // Unsupported address type
+			if (!hmac.SetKey(newkey))
+				throw ModuleException(this, "Unable to initialise HMAC-SHA256 for <hashident>!");
+
+			secret_key = newkey;
+
+			// Entries generated with the old key are no longer valid.
+			cache.assign(cachesize, CacheEntry());
 		}
 
-		return std::string(ipstr);
+		latency.ReadConfig();
 	}
 
 	/** Generate a stable 12-character ident using HMAC-SHA256 **/
 	std::string GenerateIdent(const irc::sockets::sockaddrs& addr)
 	{
-		if (!sha256)
-			throw ModuleException(this, "SHA256 module (hash/sha256) is missing!");
+		unsigned char key[17];
+		size_t keylen;
+		if (!GetAddressKey(addr, key, keylen))
+			return "unknown"; // Unsupported address type
 
-		// Normalize IP to ensure it's consistent across reconnects
-		std::string normalized_ip = NormalizeIP(addr);
+		CacheEntry* slot = FindSlot(key);
+		if (slot && slot->used && !memcmp(slot->key, key, sizeof(key)))
+			return slot->ident;
 
-		// Compute HMAC-SHA256 of IP with secret key
-		std::string raw_hash = sha256->hmac(secret_key, normalized_ip);
-		std::ostringstream hex_stream;
-		for (size_t i = 0; i < 6; i++)
+		// Hash the raw address bytes so the result doesn't depend on how the address is formatted.
+		unsigned char digest[KeyedHash::DIGEST_SIZE];
+		if (!hmac.Hash(key + 1, keylen - 1, digest))
+			throw ModuleException(this, "HMAC-SHA256 failed while generating an ident!");
+
+		static const char hexdigits[] = "0123456789abcdef";
+		char ident[IDENT_LENGTH + 1];
+		for (size_t i = 0; i < IDENT_LENGTH / 2; i++)
 		{
-			hex_stream << std::hex << std::setw(2) << std::setfill('0') 
-			           << (static_cast<unsigned char>(raw_hash[i]) & 0xFF);
+			ident[i * 2] = hexdigits[digest[i] >> 4];
+			ident[i * 2 + 1] = hexdigits[digest[i] & 0x0F];
 		}
+		ident[IDENT_LENGTH] = '\0';
 
-		return hex_stream.str();
+		if (slot)
+		{
+			memcpy(slot->key, key, sizeof(key));
+			memcpy(slot->ident, ident, sizeof(ident));
+			slot->used = true;
+		}
+		return std::string(ident, IDENT_LENGTH);
 	}
 
 	void OnUserConnect(LocalUser* user) override
 	{
+		Latency::ScopedTimer latencytimer(connect_latency);
 		if (!IS_LOCAL(user))
 			return;
 
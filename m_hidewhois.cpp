@@ -22,6 +22,8 @@
 
 #include "inspircd.h"
 #include "modules/whois.h"
+#include <array>
+#include <bitset>
 
 class ModuleHideWhois final
 	: public Module
@@ -29,30 +31,21 @@ class ModuleHideWhois final
 	, public Whois::LineEventListener
 {
 private:
-	bool allow_opers;
-	bool allow_selfview;
-	bool hide_server;
-	bool hide_idle;
-	bool hide_away;
-	bool hide_geolocation;
-	bool hide_secure;
-
-	bool ShouldHideFrom(User* source, User* target)
+	// Who is looking at the WHOIS; an oper viewing themselves is OPER | SELF.
+	enum ViewerClass
 	{
-		// Only apply to local users
-		if (!IS_LOCAL(target))
-			return false;
-			
-		// If source is an oper and opers can see all
-		if (source->IsOper() && allow_opers)
-			return false;
-			
-		// If viewing self and self-view is allowed
-		if (source == target && allow_selfview)
-			return false;
-			
-		// Hide information from regular users and from self if selfview is not allowed
-		return true;
+		VIEWER_USER = 0,
+		VIEWER_OPER = 1,
+		VIEWER_SELF = 2,
+		VIEWER_COUNT = 4
+	};
+
+	// The numerics hidden from each class of viewer, built when the config is read.
+	std::array<std::bitset<1000>, VIEWER_COUNT> hidden;
+
+	static unsigned int GetViewerClass(User* source, User* target)
+	{
+		return (source->IsOper() ? VIEWER_OPER : VIEWER_USER) | (source == target ? VIEWER_SELF : VIEWER_USER);
 	}
 
 public:
@@ -67,13 +60,31 @@ public:
 	{
 		const auto& tag = ServerInstance->Config->ConfValue("hidewhois");
 		
-		allow_opers = tag->getBool("opers", true);
-		allow_selfview = tag->getBool("selfview", true);
-		hide_server = tag->getBool("hide_server", true);
-		hide_idle = tag->getBool("hide_idle", true);
-		hide_away = tag->getBool("hide_away", true);
-		hide_geolocation = tag->getBool("hide_geolocation", true);
-		hide_secure = tag->getBool("hide_secure", true);
+		const bool allow_opers = tag->getBool("opers", true);
+		const bool allow_selfview = tag->getBool("selfview", true);
+
+		// RPL_WHOISUSER (311) and RPL_ENDOFWHOIS (318) are never hidden.
+		std::bitset<1000> mask;
+		if (tag->getBool("hide_server", true))
+			mask.set(RPL_WHOISSERVER); // 312
+		if (tag->getBool("hide_idle", true))
+			mask.set(RPL_WHOISIDLE); // 317
+		if (tag->getBool("hide_away", true))
+			mask.set(RPL_AWAY); // 301
+		if (tag->getBool("hide_geolocation", true))
+		{
+			mask.set(RPL_WHOISCOUNTRY); // 344
+			mask.set(RPL_WHOISGATEWAY); // 350
+		}
+		if (tag->getBool("hide_secure", true))
+			mask.set(RPL_WHOISSECURE); // 671 - "is using a secure connection"
+
+		// Opers (if allowed) and users viewing themselves (if allowed) see everything.
+		for (unsigned int viewer = 0; viewer < VIEWER_COUNT; ++viewer)
+		{
+			const bool exempt = ((viewer & VIEWER_OPER) && allow_opers) || ((viewer & VIEWER_SELF) && allow_selfview);
+			hidden[viewer] = exempt ? std::bitset<1000>() : mask;
+		}
 	}
 
 	void OnWhois(Whois::Context& whois) override
@@ -83,48 +94,16 @@ public:
 
 	ModResult OnWhoisLine(Whois::Context& whois, Numeric::Numeric& numeric) override
 	{
-		User* source = whois.GetSource();
 		User* target = whois.GetTarget();
-		
-		if (!ShouldHideFrom(source, target))
+
+		// Only apply to local users
+		if (!IS_LOCAL(target))
 			return MOD_RES_PASSTHRU;
-		
-		// Process specific numerics
-		switch (numeric.GetNumeric())
-		{
-			case RPL_WHOISUSER: // 311 - Don't hide the basic user information
-				return MOD_RES_PASSTHRU;
-				
-			case RPL_ENDOFWHOIS: // 318 - Don't hide the end of WHOIS
-				return MOD_RES_PASSTHRU;
-				
-			case RPL_WHOISSERVER: // 312
-				if (hide_server)
-					return MOD_RES_DENY;
-				break;
-			
-			case RPL_WHOISIDLE: // 317
-				if (hide_idle)
-					return MOD_RES_DENY;
-				break;
-			
-			case RPL_AWAY: // 301
-				if (hide_away)
-					return MOD_RES_DENY;
-				break;
-				
-			case RPL_WHOISCOUNTRY: // 344
-			case RPL_WHOISGATEWAY: // 350
-				if (hide_geolocation)
-					return MOD_RES_DENY;
-				break;
-				
-			case RPL_WHOISSECURE: // 671 - "is using a secure connection"
-				if (hide_secure)
-					return MOD_RES_DENY;
-				break;
-		}
-		
+
+		const unsigned int num = numeric.GetNumeric();
+		if (num < 1000 && hidden[GetViewerClass(whois.GetSource(), target)].test(num))
+			return MOD_RES_DENY;
+
 		return MOD_RES_PASSTHRU;
 	}
 };
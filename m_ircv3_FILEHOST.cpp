@@ -33,7 +33,22 @@
 #include "modules/account.h"
 #include "modules/ircv3.h"
 #include "clientprotocolmsg.h"
+#include "threadengine.h"
+#include "hooklatency.h"
 #include <jwt-cpp/jwt.h>
+#include <picojson/picojson.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <poll.h>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
 
 
 // File type enumeration for metadata
@@ -47,68 +62,517 @@ enum FileType
     FILE_DOCUMENT
 };
 
-// JWT wrapper class using jwt-cpp library
-class JWT
+// Compile-time perfect hash from a file extension to its FileType. Extensions
+// of up to four characters are packed into a 32-bit key which is then hashed
+// with a multiplier chosen so every known extension gets its own slot.
+namespace FileTypes
+{
+    struct Entry
+    {
+        uint32_t key;
+        FileType type;
+    };
+
+    constexpr size_t MAX_LENGTH = 4;
+    constexpr unsigned int TABLE_BITS = 5;
+    constexpr uint32_t MULTIPLIER = 0x90710953;
+
+    constexpr uint32_t Pack(std::string_view ext)
+    {
+        uint32_t key = 0;
+        for (size_t i = 0; i < ext.size() && i < MAX_LENGTH; ++i)
+        {
+            char c = ext[i];
+            if (c >= 'A' && c <= 'Z')
+                c += 'a' - 'A';
+            key |= static_cast<uint32_t>(static_cast<unsigned char>(c)) << (8 * i);
+        }
+        return key;
+    }
+
+    constexpr size_t Slot(uint32_t key)
+    {
+        return static_cast<uint32_t>(key * MULTIPLIER) >> (32 - TABLE_BITS);
+    }
+
+    constexpr Entry known[] = {
+        { Pack("png"), FILE_IMAGE }, { Pack("jpg"), FILE_IMAGE }, { Pack("jpeg"), FILE_IMAGE },
+        { Pack("gif"), FILE_IMAGE }, { Pack("svg"), FILE_IMAGE },
+        { Pack("txt"), FILE_TEXT }, { Pack("md"), FILE_TEXT }, { Pack("html"), FILE_TEXT },
+        { Pack("htm"), FILE_TEXT }, { Pack("css"), FILE_TEXT }, { Pack("js"), FILE_TEXT },
+        { Pack("pdf"), FILE_DOCUMENT }, { Pack("doc"), FILE_DOCUMENT }, { Pack("docx"), FILE_DOCUMENT },
+        { Pack("zip"), FILE_ARCHIVE }, { Pack("tar"), FILE_ARCHIVE }, { Pack("gz"), FILE_ARCHIVE },
+        { Pack("rar"), FILE_ARCHIVE },
+    };
+
+    constexpr std::array<Entry, 1 << TABLE_BITS> BuildTable()
+    {
+        std::array<Entry, 1 << TABLE_BITS> table = { };
+        for (const auto& entry : known)
+            table[Slot(entry.key)] = entry;
+        return table;
+    }
+
+    constexpr bool IsPerfect()
+    {
+        for (size_t i = 0; i < std::size(known); ++i)
+            for (size_t j = i + 1; j < std::size(known); ++j)
+                if (Slot(known[i].key) == Slot(known[j].key))
+                    return false;
+        return true;
+    }
+
+    static_assert(IsPerfect(), "FileTypes::MULTIPLIER must map every known extension to its own slot");
+
+    constexpr auto table = BuildTable();
+
+    constexpr FileType FromFilename(std::string_view filename)
+    {
+        const size_t dot_pos = filename.rfind('.');
+        if (dot_pos == std::string_view::npos || dot_pos + 1 == filename.size())
+            return FILE_UNKNOWN;
+
+        const std::string_view ext = filename.substr(dot_pos + 1);
+        if (ext.size() > MAX_LENGTH)
+            return FILE_BINARY;
+
+        const uint32_t key = Pack(ext);
+        const Entry& entry = table[Slot(key)];
+        return entry.key == key ? entry.type : FILE_BINARY;
+    }
+
+    constexpr const char* Name(FileType type)
+    {
+        switch (type)
+        {
+            case FILE_IMAGE:
+                return "image";
+            case FILE_TEXT:
+                return "text";
+            case FILE_DOCUMENT:
+                return "document";
+            case FILE_ARCHIVE:
+                return "archive";
+            case FILE_BINARY:
+                return "binary";
+            default:
+                return "unknown";
+        }
+    }
+}
+
+// Metadata reported by the file host for a single file.
+struct FileMetadata
+{
+    uint64_t size = 0;
+    std::string mime;
+    unsigned int width = 0;
+    unsigned int height = 0;
+};
+
+// Server-wide LRU of file metadata keyed by filename. Lookups which failed are
+// cached as well, for a shorter time, so a broken link is not fetched again on
+// every message but a file host outage is soon forgotten.
+class MetadataCache
 {
  public:
-    static std::string Generate(const std::string& username, const std::string& secret, const std::string& issuer, time_t expiry)
+    struct Entry
     {
-        // Simplified token generation using the provided issuer
-        auto token = jwt::create()
-            .set_issuer(issuer)
-            .set_subject(username)
-            .set_issued_at(std::chrono::system_clock::from_time_t(ServerInstance->Time()))
-            .set_expires_at(std::chrono::system_clock::from_time_t(expiry))
-            .sign(jwt::algorithm::hs256{secret});
+        bool valid;
+        time_t fetched;
+        FileMetadata metadata;
+    };
 
-        return token;
+ private:
+    using List = std::list<std::pair<std::string, Entry>>;
+
+    List entries;
+    std::unordered_map<std::string, List::iterator> index;
+    size_t capacity = 0;
+    unsigned long ttl = 0;
+    unsigned long fail_ttl = 0;
+
+ public:
+    void Configure(size_t newcapacity, unsigned long newttl, unsigned long newfailttl)
+    {
+        capacity = newcapacity;
+        ttl = newttl;
+        fail_ttl = newfailttl;
+        while (entries.size() > capacity)
+        {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
     }
 
-    static bool Verify(const std::string& token, const std::string& secret, const std::string& issuer)
+    // Returns the entry for filename, or nullptr if there is none or it has
+    // expired. A hit makes the entry the most recently used.
+    const Entry* Find(const std::string& filename)
     {
-        try
+        auto it = index.find(filename);
+        if (it == index.end())
+            return nullptr;
+
+        const Entry& entry = it->second->second;
+        if (entry.fetched + static_cast<time_t>(entry.valid ? ttl : fail_ttl) <= ServerInstance->Time())
         {
-            // Verify the token with the provided secret and issuer
-            auto verifier = jwt::verify()
-                .allow_algorithm(jwt::algorithm::hs256{secret})
-                .with_issuer(issuer);
+            entries.erase(it->second);
+            index.erase(it);
+            return nullptr;
+        }
+
+        entries.splice(entries.begin(), entries, it->second);
+        return &it->second->second;
+    }
 
-            auto decoded = jwt::decode(token);
-            verifier.verify(decoded);
+    void Store(const std::string& filename, const Entry& entry)
+    {
+        if (!capacity)
+            return;
 
-            return true;
+        auto it = index.find(filename);
+        if (it != index.end())
+        {
+            it->second->second = entry;
+            entries.splice(entries.begin(), entries, it->second);
+            return;
         }
-        catch (const std::exception&)
+
+        if (entries.size() >= capacity)
         {
-            return false;
+            index.erase(entries.back().first);
+            entries.pop_back();
         }
+
+        entries.emplace_front(filename, entry);
+        index.emplace(filename, entries.begin());
     }
-    
-    static std::string GetUsername(const std::string& token)
+
+    void Clear()
+    {
+        index.clear();
+        entries.clear();
+    }
+};
+
+// Waits until a non-blocking BIO can make progress. Fails once the deadline
+// has passed or the worker has been told to stop.
+static bool WaitForBIO(BIO* bio, std::chrono::steady_clock::time_point deadline, const std::function<bool()>& stopping, std::string& error)
+{
+    // Wake up regularly so a stop request never waits on the network.
+    static constexpr long long SLICE_MS = 100;
+
+    int fd = -1;
+    if (BIO_get_fd(bio, &fd) < 0 || fd < 0)
+    {
+        error = "connection has no socket";
+        return false;
+    }
+
+    pollfd pfd = { fd, static_cast<short>(BIO_should_read(bio) ? POLLIN : POLLOUT), 0 };
+    for (;;)
     {
-        try
+        if (stopping())
         {
-            auto decoded = jwt::decode(token);
-            return decoded.get_subject();
+            error = "cancelled";
+            return false;
         }
-        catch (const std::exception&)
+
+        const long long remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if (remaining <= 0)
         {
-            return "";
+            error = "timed out";
+            return false;
+        }
+
+        const int ready = poll(&pfd, 1, static_cast<int>(std::min(remaining, SLICE_MS)));
+        if (ready > 0)
+            return true;
+
+        if (ready < 0 && errno != EINTR)
+        {
+            error = "unable to wait for the connection";
+            return false;
         }
     }
-    
-    static std::string GetIssuer(const std::string& token)
+}
+
+// HTTP(S) GET used by the metadata worker thread. The whole request must
+// complete within timeout seconds and is abandoned as soon as stopping returns
+// true. The request is made with HTTP/1.0 so the body is never chunked.
+static bool FetchURL(SSL_CTX* ctx, const std::string& url, unsigned long timeout, const std::function<bool()>& stopping, std::string& body, std::string& error)
+{
+    static constexpr size_t MAX_RESPONSE = 64 * 1024;
+
+    bool tls;
+    size_t hostpos;
+    if (url.compare(0, 8, "https://") == 0)
+    {
+        tls = true;
+        hostpos = 8;
+    }
+    else if (url.compare(0, 7, "http://") == 0)
+    {
+        tls = false;
+        hostpos = 7;
+    }
+    else
+    {
+        error = "unsupported URL scheme";
+        return false;
+    }
+
+    const size_t pathpos = url.find('/', hostpos);
+    std::string host = url.substr(hostpos, pathpos - hostpos);
+    const std::string path = pathpos == std::string::npos ? "/" : url.substr(pathpos);
+    std::string port = tls ? "443" : "80";
+    const size_t colon = host.rfind(':');
+    if (colon != std::string::npos && host.find(']', colon) == std::string::npos)
+    {
+        port = host.substr(colon + 1);
+        host.erase(colon);
+    }
+
+    BIO* bio = tls ? BIO_new_ssl_connect(ctx) : BIO_new(BIO_s_connect());
+    if (!bio)
+    {
+        error = "unable to create a connection";
+        return false;
+    }
+
+    if (tls)
     {
-        try
+        SSL* ssl = nullptr;
+        BIO_get_ssl(bio, &ssl);
+        SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY);
+        SSL_set_tlsext_host_name(ssl, host.c_str());
+        SSL_set1_host(ssl, host.c_str());
+    }
+
+    // The socket is non-blocking so that an unreachable host can not hold the
+    // worker, and with it StopFetcher, for the system TCP connect timeout.
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
+    BIO_set_conn_hostname(bio, (host + ":" + port).c_str());
+    BIO_set_nbio(bio, 1);
+    while (BIO_do_connect(bio) <= 0)
+    {
+        if (BIO_should_retry(bio) && WaitForBIO(bio, deadline, stopping, error))
+            continue;
+
+        error = "unable to connect to " + host + ":" + port + (error.empty() ? "" : ": " + error);
+        BIO_free_all(bio);
+        return false;
+    }
+
+    const std::string request = "GET " + path + " HTTP/1.0\r\nHost: " + host + "\r\nAccept: application/json\r\nConnection: close\r\n\r\n";
+    size_t written = 0;
+    while (written < request.size())
+    {
+        const int len = BIO_write(bio, request.data() + written, static_cast<int>(request.size() - written));
+        if (len > 0)
+        {
+            written += len;
+            continue;
+        }
+
+        if (BIO_should_retry(bio) && WaitForBIO(bio, deadline, stopping, error))
+            continue;
+
+        error = "unable to send the request" + (error.empty() ? "" : ": " + error);
+        BIO_free_all(bio);
+        return false;
+    }
+
+    std::string response;
+    char buffer[4096];
+    while (response.size() < MAX_RESPONSE)
+    {
+        const int len = BIO_read(bio, buffer, sizeof(buffer));
+        if (len > 0)
         {
-            auto decoded = jwt::decode(token);
-            return decoded.get_issuer();
+            response.append(buffer, len);
+            continue;
         }
-        catch (const std::exception&)
+
+        // The server closes the connection once the response is complete.
+        if (len == 0 || !BIO_should_retry(bio))
+            break;
+
+        if (!WaitForBIO(bio, deadline, stopping, error))
         {
-            return "";
+            error = "unable to read the response: " + error;
+            BIO_free_all(bio);
+            return false;
         }
     }
+    BIO_free_all(bio);
+
+    if (response.compare(0, 5, "HTTP/") != 0)
+    {
+        error = "malformed response";
+        return false;
+    }
+
+    const size_t status = response.find(' ');
+    if (status == std::string::npos || response.compare(status + 1, 3, "200") != 0)
+    {
+        error = "unexpected response: " + response.substr(0, response.find('\r'));
+        return false;
+    }
+
+    const size_t headerend = response.find("\r\n\r\n");
+    if (headerend == std::string::npos)
+    {
+        error = "truncated response";
+        return false;
+    }
+
+    body.assign(response, headerend + 4, std::string::npos);
+    return true;
+}
+
+// Parses the file host's answer, e.g.
+//   {"size":48213,"mime":"image/png","width":640,"height":480}
+// Every field is optional.
+static bool ParseMetadata(const std::string& body, FileMetadata& metadata, std::string& error)
+{
+    picojson::value root;
+    error = picojson::parse(root, body);
+    if (!error.empty())
+        return false;
+
+    if (!root.is<picojson::object>())
+    {
+        error = "response is not a JSON object";
+        return false;
+    }
+
+    const auto& object = root.get<picojson::object>();
+    const auto number = [&object](const char* key) -> double
+    {
+        auto it = object.find(key);
+        return it != object.end() && it->second.is<double>() && it->second.get<double>() > 0 ? it->second.get<double>() : 0;
+    };
+
+    metadata.size = static_cast<uint64_t>(number("size"));
+    metadata.width = static_cast<unsigned int>(number("width"));
+    metadata.height = static_cast<unsigned int>(number("height"));
+
+    auto mime = object.find("mime");
+    if (mime != object.end() && mime->second.is<std::string>())
+        metadata.mime = mime->second.get<std::string>();
+    return true;
+}
+
+class ModuleFileHost;
+
+// Worker thread which fetches file metadata from the file host so the main
+// loop never waits on the network.
+class MetadataFetcher final : public SocketThread
+{
+ public:
+    struct Request
+    {
+        std::string filename;
+        std::string url;
+    };
+
+    struct Result
+    {
+        std::string filename;
+        bool valid;
+        FileMetadata metadata;
+        std::string error;
+    };
+
+ private:
+    ModuleFileHost* const mod;
+    SSL_CTX* const ctx;
+    const unsigned long timeout;
+    std::deque<Request> requests;
+    std::vector<Result> results;
+
+ public:
+    MetadataFetcher(ModuleFileHost* m, SSL_CTX* c, unsigned long t)
+        : mod(m)
+        , ctx(c)
+        , timeout(t)
+    {
+    }
+
+    void Queue(Request&& request)
+    {
+        LockQueue();
+        requests.push_back(std::move(request));
+        UnlockQueueWakeup();
+    }
+
+    void OnStart() override
+    {
+        while (!IsStopping())
+        {
+            LockQueue();
+            while (requests.empty() && !IsStopping())
+                WaitForQueue();
+
+            if (IsStopping())
+            {
+                UnlockQueue();
+                break;
+            }
+
+            Request request = std::move(requests.front());
+            requests.pop_front();
+            UnlockQueue();
+
+            Result result;
+            result.filename = std::move(request.filename);
+            std::string body;
+            result.valid = FetchURL(ctx, request.url, timeout, [this] { return IsStopping(); }, body, result.error)
+                && ParseMetadata(body, result.metadata, result.error);
+
+            LockQueue();
+            results.push_back(std::move(result));
+            UnlockQueue();
+            NotifyParent();
+        }
+    }
+
+    void OnStop() override
+    {
+        LockQueue();
+        UnlockQueueWakeup();
+    }
+
+    void OnNotify() override;
+};
+
+// JWT wrapper class using jwt-cpp library. The signing key is built once by
+// Configure and reused for every token. Tokens are only ever verified by the
+// file host itself.
+class JWT
+{
+ private:
+    std::string issuer;
+    std::optional<jwt::algorithm::hs256> algorithm;
+
+ public:
+    void Configure(const std::string& secret, const std::string& newissuer)
+    {
+        issuer = newissuer;
+        algorithm.emplace(secret);
+    }
+
+    std::string Generate(const std::string& username, time_t expiry) const
+    {
+        // Simplified token generation using the configured issuer
+        return jwt::create()
+            .set_issuer(issuer)
+            .set_subject(username)
+            .set_issued_at(std::chrono::system_clock::from_time_t(ServerInstance->Time()))
+            .set_expires_at(std::chrono::system_clock::from_time_t(expiry))
+            .sign(*algorithm);
+    }
 };
 
 // Filehost message tag provider
@@ -145,32 +609,79 @@ class FileHostTag final : public ClientProtocol::MessageTagProvider
 class CommandFilehost : public SplitCommand
 {
  private:
+    // A token issued to an account, reused until shortly before it expires.
+    struct CachedToken
+    {
+        std::string subject;
+        std::string token;
+        time_t expiry;
+    };
+
+    // Sweep out expired tokens once the cache grows past this many accounts.
+    static constexpr size_t TOKEN_CACHE_SWEEP = 1024;
+
     std::string& public_url;
-    std::string& jwt_secret;
-    std::string& jwt_issuer;
-    unsigned int token_expiry;
+    const JWT& jwt;
+    unsigned int& token_expiry;
+    Account::API accountapi;
+    std::unordered_map<std::string, CachedToken> tokens;
+
+    const CachedToken& GetToken(const std::string& account, const std::string& subject)
+    {
+        // Reissue once less than a tenth of the lifetime is left so the link
+        // we hand out is never about to expire.
+        const time_t now = ServerInstance->Time();
+        const time_t refresh = token_expiry / 10;
+
+        auto it = tokens.find(account);
+        if (it != tokens.end() && it->second.subject == subject && it->second.expiry - refresh > now)
+            return it->second;
+
+        if (it == tokens.end() && tokens.size() >= TOKEN_CACHE_SWEEP)
+        {
+            for (auto sweep = tokens.begin(); sweep != tokens.end(); )
+            {
+                if (sweep->second.expiry - refresh <= now)
+                    sweep = tokens.erase(sweep);
+                else
+                    ++sweep;
+            }
+        }
+
+        const time_t expiry = now + token_expiry;
+        CachedToken& cached = tokens[account];
+        cached.subject = subject;
+        cached.token = jwt.Generate(subject, expiry);
+        cached.expiry = expiry;
+        return cached;
+    }
     
  public:
     std::string filehost_auth_msg;  // Made public so it can be accessed by the Module class
     
-    CommandFilehost(Module* parent, std::string& url, std::string& secret, std::string& issuer, unsigned int expiry)
+    CommandFilehost(Module* parent, std::string& url, const JWT& signer, unsigned int& expiry)
         : SplitCommand(parent, "FILEHOST", 0)
         , public_url(url)
-        , jwt_secret(secret)
-        , jwt_issuer(issuer)
+        , jwt(signer)
         , token_expiry(expiry)
+        , accountapi(parent)
     {
         syntax.push_back("[info]");
         penalty = 2;  // Small penalty to prevent abuse
         filehost_auth_msg = ServerInstance->Config->ConfValue("filehost")->getString("auth_message", "Use /msg NickServ IDENTIFY password to log in.");
     }
 
+    // Forget all issued tokens, e.g. after the signing key has changed.
+    void ClearTokens()
+    {
+        tokens.clear();
+    }
+
     CmdResult HandleLocal(LocalUser* user, const Params& parameters) override
     {
         // Check if the user is identified with services (account)
         const std::string* accountname = nullptr;
         
-        Account::API accountapi(this->creator);
         if (accountapi && *accountapi)
         {
             accountname = (*accountapi)->GetAccountName(user);
@@ -182,10 +693,8 @@ class CommandFilehost : public SplitCommand
             return CmdResult::FAILURE;
         }
 
-        // Simplified token generation using the existing JWT::Generate method
-        time_t expiry = ServerInstance->Time() + token_expiry;
-        std::string token = JWT::Generate(user->nick, jwt_secret, jwt_issuer, expiry);
-        std::string auth_url = public_url + "/upload?token=" + token;
+        const CachedToken& token = GetToken(*accountname, user->nick);
+        std::string auth_url = public_url + "/upload?token=" + token.token;
 
         // User is authorized, send file upload instructions with JWT token
         if (parameters.empty())
@@ -194,7 +703,7 @@ class CommandFilehost : public SplitCommand
             user->WriteNotice("*** FILEHOST: You're already authenticated through IRC! No need to log in again.");
             user->WriteNotice("*** FILEHOST: Share files with others using " + public_url + "/files/filename");
             user->WriteNotice("*** FILEHOST: Your logged in account: " + *accountname);
-            user->WriteNotice("*** FILEHOST: Your upload link is valid for " + ConvToStr(token_expiry / 60) + " minutes");
+            user->WriteNotice("*** FILEHOST: Your upload link is valid for " + ConvToStr((token.expiry - ServerInstance->Time()) / 60) + " minutes");
             return CmdResult::SUCCESS;
         }
         else if (parameters[0] == "info")
@@ -218,119 +727,133 @@ class ModuleFileHost : public Module, public ISupport::EventListener, public Cap
     std::string jwt_secret;
     std::string jwt_issuer;
     unsigned int token_expiry;
+    JWT jwt;
     CommandFilehost cmd;
     FileHostTag filetag;
     Events::ModuleEventProvider tagevprov;
-    CTCTags::CapReference ctctagcap;
+    Latency::Monitor latency;
+    Latency::Histogram& premessage_latency;
     
-    // Helper to determine file type from extension
-    FileType GetFileTypeFromExtension(const std::string& filename) const
+    // Searcher for public_url, rebuilt whenever the URL changes. It refers to
+    // url_needle so the two must be updated together.
+    std::string url_needle;
+    std::optional<std::boyer_moore_horspool_searcher<std::string::const_iterator>> url_searcher;
+
+    // Reused buffer for the JSON value of the reverse.im/filehost tag.
+    std::string metadata;
+
+    // Asynchronous metadata enrichment. Disabled when metadata_url is empty.
+    std::string metadata_url;
+    unsigned long metadata_timeout = 0;
+    MetadataCache metadata_cache;
+    std::unordered_set<std::string> metadata_pending;
+    std::string metadata_key;
+    SSL_CTX* metadata_ctx = nullptr;
+    std::unique_ptr<MetadataFetcher> fetcher;
+
+    // Filenames are sent to the metadata API verbatim so only allow a
+    // conservative set of characters. Percent is excluded so an encoded path
+    // such as %2e%2e%2f can not escape the metadata endpoint.
+    static bool IsSafeFilename(std::string_view filename)
     {
-        std::string ext;
-        size_t dot_pos = filename.rfind('.');
-        
-        if (dot_pos != std::string::npos)
-            ext = filename.substr(dot_pos + 1);
-            
-        if (ext.empty())
-            return FILE_UNKNOWN;
-            
-        // Convert to lowercase for comparison
-        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-        
-        // Image formats
-        if (ext == "png" || ext == "jpg" || ext == "jpeg" || ext == "gif" || ext == "svg")
-            return FILE_IMAGE;
-            
-        // Text formats
-        if (ext == "txt" || ext == "html" || ext == "htm" || ext == "css" || ext == "js")
-            return FILE_TEXT;
-            
-        // Document formats
-        if (ext == "pdf" || ext == "doc" || ext == "docx")
-            return FILE_DOCUMENT;
-            
-        // Archive formats
-        if (ext == "zip" || ext == "tar" || ext == "gz" || ext == "rar")
-            return FILE_ARCHIVE;
-            
-        return FILE_BINARY;
+        if (filename.empty() || filename.size() > 255 || filename == "." || filename == "..")
+            return false;
+
+        for (unsigned char c : filename)
+        {
+            if (!isalnum(c) && c != '.' && c != '-' && c != '_' && c != '~')
+                return false;
+        }
+        return true;
     }
-    
-    // Extract filename from URL
-    std::string GetFilenameFromURL(const std::string& url) const
+
+    // Returns the cached metadata for a file, queueing a fetch on a miss.
+    const MetadataCache::Entry* FindFileMetadata(std::string_view filename)
     {
-        // Check if it's our filehost URL
-        if (url.find(public_url + "/files/") != 0)
-            return "";
-            
-        // Extract the filename part
-        std::string filename = url.substr((public_url + "/files/").length());
-        
-        // Remove any query parameters
-        size_t qmark = filename.find('?');
-        if (qmark != std::string::npos)
-            filename = filename.substr(0, qmark);
-            
-        return filename;
+        if (!fetcher || !IsSafeFilename(filename))
+            return nullptr;
+
+        metadata_key.assign(filename);
+        const MetadataCache::Entry* entry = metadata_cache.Find(metadata_key);
+        if (entry)
+            return entry->valid ? entry : nullptr;
+
+        // Bound the backlog in case the file host is down.
+        static constexpr size_t MAX_PENDING = 256;
+        if (metadata_pending.size() < MAX_PENDING && metadata_pending.insert(metadata_key).second)
+            fetcher->Queue({ metadata_key, metadata_url + metadata_key });
+
+        return nullptr;
     }
-    
-    // Create metadata for file
-    void AddFileMetadataTags(ClientProtocol::TagMap& tags, const std::string& url)
+
+    void StopFetcher()
     {
-        std::string filename = GetFilenameFromURL(url);
-        if (filename.empty())
-            return;
-            
-        FileType type = GetFileTypeFromExtension(filename);
-        
-        // Create JSON metadata structure
-        std::string metadata = "{\"url\":\"" + url + "\",\"filename\":\"" + filename + "\"";
-        
-        // Add file type
-        switch (type)
+        if (fetcher)
         {
-            case FILE_IMAGE:
-                metadata += ",\"type\":\"image\"";
-                break;
-            case FILE_TEXT:
-                metadata += ",\"type\":\"text\"";
-                break;
-            case FILE_DOCUMENT:
-                metadata += ",\"type\":\"document\"";
-                break;
-            case FILE_ARCHIVE:
-                metadata += ",\"type\":\"archive\"";
-                break;
-            case FILE_BINARY:
-                metadata += ",\"type\":\"binary\"";
-                break;
-            default:
-                metadata += ",\"type\":\"unknown\"";
+            fetcher->Stop();
+            fetcher.reset();
         }
-        
-        metadata += "}";
-        
-        // Add tag to tagmap
-        tags.emplace("reverse.im/filehost", ClientProtocol::MessageTagData(&filetag, metadata));
+        metadata_pending.clear();
     }
 
-    void SendTagMsg(User* user, const std::string& url, const std::string& metadata)
+    static void AppendJSONString(std::string& out, std::string_view str)
     {
-        // Create a tag map to hold the metadata
-        ClientProtocol::TagMap tags;
-        AddFileMetadataTags(tags, url);
+        static constexpr char hex[] = "0123456789abcdef";
 
-        // Corrected to use CTCTags::TagMessage directly.
-        CTCTags::TagMessage tagmsg(user, "*", tags);
-        // Wrap the CTCTags::TagMessage in a ClientProtocol::Event and send it.
-        ClientProtocol::Event tagEvent(ServerInstance->GetRFCEvents().privmsg, tagmsg);
-        for (const auto& [_, current_user] : ServerInstance->Users.GetUsers()) {
-            LocalUser* localuser = IS_LOCAL(current_user);
-            if (localuser && ctctagcap.IsEnabled(localuser)) {
-                localuser->Send(tagEvent);
+        out.push_back('"');
+        for (unsigned char c : str)
+        {
+            if (c < 0x20)
+            {
+                // Control characters such as IRC formatting must be escaped.
+                out.append("\\u00");
+                out.push_back(hex[c >> 4]);
+                out.push_back(hex[c & 0xF]);
+                continue;
             }
+
+            if (c == '"' || c == '\\')
+                out.push_back('\\');
+            out.push_back(c);
         }
+        out.push_back('"');
+    }
+
+    // Build the tag value for a file URL into the metadata buffer.
+    void BuildMetadata(std::string_view url, std::string_view filename)
+    {
+        metadata.clear();
+        metadata.append("{\"url\":");
+        AppendJSONString(metadata, url);
+        if (!filename.empty())
+        {
+            metadata.append(",\"filename\":");
+            AppendJSONString(metadata, filename);
+            metadata.append(",\"type\":\"").append(FileTypes::Name(FileTypes::FromFilename(filename))).push_back('"');
+
+            const MetadataCache::Entry* entry = FindFileMetadata(filename);
+            if (entry)
+            {
+                const FileMetadata& info = entry->metadata;
+                if (info.size)
+                    metadata.append(",\"size\":").append(ConvToStr(info.size));
+                if (!info.mime.empty())
+                {
+                    metadata.append(",\"mime\":");
+                    AppendJSONString(metadata, info.mime);
+                }
+                if (info.width && info.height)
+                    metadata.append(",\"width\":").append(ConvToStr(info.width)).append(",\"height\":").append(ConvToStr(info.height));
+            }
+        }
+        metadata.push_back('}');
+    }
+
+    // Find the next occurrence of public_url in text at or after pos.
+    size_t FindURL(const std::string& text, size_t pos) const
+    {
+        auto it = std::search(text.begin() + pos, text.end(), *url_searcher);
+        return it == text.end() ? std::string::npos : it - text.begin();
     }
 
  public:
@@ -339,25 +862,51 @@ class ModuleFileHost : public Module, public ISupport::EventListener, public Cap
         , ISupport::EventListener(this)
         , Cap::Capability(this, "reverse.im/filehost")
         , CTCTags::EventListener(this)
-        , cmd(this, public_url, jwt_secret, jwt_issuer, token_expiry)
+        , cmd(this, public_url, jwt, token_expiry)
         , filetag(this, *this)
         , tagevprov(this, "event/filehost")
-        , ctctagcap(this)
+        , latency(this, "filehost")
+        , premessage_latency(latency.Add("OnUserPreMessage"))
     {
     }
 
+    ~ModuleFileHost() override
+    {
+        StopFetcher();
+        if (metadata_ctx)
+            SSL_CTX_free(metadata_ctx);
+    }
+
+    void OnMetadata(MetadataFetcher::Result& result)
+    {
+        metadata_pending.erase(result.filename);
+        if (!result.valid)
+            ServerInstance->Logs.Debug(MODNAME, "Unable to fetch metadata for {}: {}", result.filename, result.error);
+
+        metadata_cache.Store(result.filename, { result.valid, ServerInstance->Time(), std::move(result.metadata) });
+    }
+
     void ReadConfig(ConfigStatus& status) override
     {
+        latency.ReadConfig();
         const auto& tag = ServerInstance->Config->ConfValue("filehost");
         
         require_ssl = tag->getBool("requiressl", true);
         
         // Get the public URL from configuration
-        public_url = tag->getString("website", "https://filehost.example.com");
+        std::string website = tag->getString("website", "https://filehost.example.com", 1);
         
         // Ensure the URL doesn't end with a trailing slash
-        if (!public_url.empty() && public_url.back() == '/')
-            public_url.pop_back();
+        if (website.back() == '/')
+            website.pop_back();
+
+        if (website.empty())
+            throw ModuleException(this, "<filehost:website> must not be empty, at " + tag->source.str());
+
+        public_url = website;
+        url_searcher.reset();
+        url_needle = public_url;
+        url_searcher.emplace(url_needle.cbegin(), url_needle.cend());
             
         // Get the JWT secret from configuration
         jwt_secret = tag->getString("jwt_secret", "defaultsecret");
@@ -367,10 +916,43 @@ class ModuleFileHost : public Module, public ISupport::EventListener, public Cap
         
         // Get the token expiry time from configuration (default to 1 hour)
         token_expiry = tag->getNum<unsigned int>("token_expiry", 3600, 60, 86400);
+
+        // Rebuild the signer and drop tokens signed with the old key
+        jwt.Configure(jwt_secret, jwt_issuer);
+        cmd.ClearTokens();
         
         // Update command authentication message if config changes
         std::string new_auth_msg = tag->getString("auth_message", "Use /msg NickServ IDENTIFY password to log in.");
         cmd.filehost_auth_msg = new_auth_msg;
+
+        // Metadata API, queried as <metadata_url><filename>
+        const std::string new_metadata_url = tag->getString("metadata_url");
+        const unsigned long new_metadata_timeout = tag->getDuration("metadata_timeout", 5, 1, 60);
+        metadata_cache.Configure(tag->getNum<size_t>("metadata_cache", 4096, 0, 1000000), tag->getDuration("metadata_ttl", 3600, 60),
+            tag->getDuration("metadata_fail_ttl", 60, 1));
+
+        if (new_metadata_url != metadata_url || new_metadata_timeout != metadata_timeout)
+        {
+            StopFetcher();
+            metadata_cache.Clear();
+            metadata_url = new_metadata_url;
+            metadata_timeout = new_metadata_timeout;
+        }
+
+        if (!metadata_url.empty() && !fetcher)
+        {
+            if (!metadata_ctx)
+            {
+                metadata_ctx = SSL_CTX_new(TLS_client_method());
+                if (!metadata_ctx)
+                    throw ModuleException(this, "Unable to create a TLS context for <filehost:metadata_url>");
+                SSL_CTX_set_verify(metadata_ctx, SSL_VERIFY_PEER, nullptr);
+                SSL_CTX_set_default_verify_paths(metadata_ctx);
+            }
+
+            fetcher = std::make_unique<MetadataFetcher>(this, metadata_ctx, metadata_timeout);
+            fetcher->Start();
+        }
     }
 
     void OnBuildISupport(ISupport::TokenMap& tokens) override
@@ -380,98 +962,58 @@ class ModuleFileHost : public Module, public ISupport::EventListener, public Cap
 
     ModResult OnUserPreMessage(User* user, MessageTarget& target, MessageDetails& details) override
     {
+        Latency::ScopedTimer latencytimer(premessage_latency);
+        static constexpr std::string_view files_path = "/files/";
+
+        const std::string& text = details.text;
+        size_t start_pos = FindURL(text, 0);
+        if (start_pos == std::string::npos)
+            return MOD_RES_PASSTHRU;
+
         // If we require SSL, check if users are trying to use FILEHOST over a non-SSL connection
         if (require_ssl)
         {
             LocalUser* localuser = IS_LOCAL(user);
-            if (localuser && !localuser->eh.GetIOHook() && 
-                (details.text.find(public_url) != std::string::npos))
+            if (localuser && !localuser->eh.GetIOHook())
             {
                 // User is trying to send a FILEHOST URL over a non-SSL connection
                 user->WriteNotice("You cannot send FILEHOST URLs over a non-SSL connection. Please use an SSL connection.");
                 return MOD_RES_DENY;
             }
         }
-        
-        // Simple check for filehost URLs
-        bool has_url = false;
-        std::string url;
-        size_t start_pos = std::string::npos;
-        
-        // Check for both your configured domain and hardcoded domain
-        if (details.text.find(public_url + "/files/") != std::string::npos) 
-        {
-            start_pos = details.text.find(public_url + "/files/");
-            has_url = true;
-        }
-    
-        if (has_url)
-        {
-            // Extract the complete URL
-            size_t end_pos = details.text.find_first_of(" \r\n", start_pos);
-            if (end_pos == std::string::npos)
-                end_pos = details.text.length();
-                
-            url = details.text.substr(start_pos, end_pos - start_pos);
-            
-            // Simple clean up of URL (remove trailing punctuation)
-            const std::string punctuation = ",.;:!?'\"()[]{}";
-            while (!url.empty() && punctuation.find(url.back()) != std::string::npos)
-            {
-                url.pop_back();
-            }
-            
-            // Extract filename from URL
-            std::string filename;
-            if (url.find(public_url + "/files/") != std::string::npos)
-            {
-                filename = url.substr((public_url + "/files/").length());
-            }
-  
-            // Create JSON metadata with file info
-            std::string metadata = "{\"url\":\"" + url + "\"";
-            
-            // Add filename if available
-            if (!filename.empty())
-            {
-                metadata += ",\"filename\":\"" + filename + "\"";
-                
-                // Try to determine file type based on extension
-                std::string ext;
-                size_t dot_pos = filename.rfind('.');
-                if (dot_pos != std::string::npos)
-                {
-                    ext = filename.substr(dot_pos + 1);
-                    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-                    
-                    // Add file type if we can determine it
-                    if (ext == "png" || ext == "jpg" || ext == "jpeg" || ext == "gif" || ext == "svg")
-                    {
-                        metadata += ",\"type\":\"image\"";
-                    }
-                    else if (ext == "txt" || ext == "md" || ext == "html" || ext == "htm")
-                    {
-                        metadata += ",\"type\":\"text\"";
-                    }
-                    else if (ext == "pdf" || ext == "doc" || ext == "docx")
-                    {
-                        metadata += ",\"type\":\"document\"";
-                    }
-                }
-            }
-            
-            // Close the JSON object
-            metadata += "}";
-            
-            // Add tag directly to message using emplace instead of operator[]
-            details.tags_out.emplace("reverse.im/filehost", ClientProtocol::MessageTagData(&filetag, metadata));
-            
-            // Send TAGMSG to the user
-            SendTagMsg(user, url, metadata);
-            
-            ServerInstance->Logs.Debug(MODNAME, "Added tag to message with URL: {}", url);
-        }
-        
+
+        // Skip mentions of the site which are not links to a file.
+        while (start_pos != std::string::npos && text.compare(start_pos + public_url.size(), files_path.size(), files_path) != 0)
+            start_pos = FindURL(text, start_pos + 1);
+
+        if (start_pos == std::string::npos)
+            return MOD_RES_PASSTHRU;
+
+        // Extract the complete URL
+        size_t end_pos = text.find_first_of(" \r\n", start_pos);
+        if (end_pos == std::string::npos)
+            end_pos = text.length();
+
+        // Simple clean up of URL (remove trailing punctuation)
+        static constexpr std::string_view punctuation = ",.;:!?'\"()[]{}";
+        while (end_pos > start_pos && punctuation.find(text[end_pos - 1]) != std::string_view::npos)
+            end_pos--;
+
+        const std::string_view url(text.data() + start_pos, end_pos - start_pos);
+
+        // Extract filename from URL, without any query or fragment.
+        std::string_view filename = url.substr(std::min(url.size(), public_url.size() + files_path.size()));
+        filename = filename.substr(0, filename.find_first_of("?#"));
+
+        BuildMetadata(url, filename);
+
+        // Add tag directly to message using emplace instead of operator[]. The
+        // core serializes the message once per protocol and delivers it only to
+        // the recipients of this message; FileHostTag strips the tag for the
+        // ones without the capability.
+        details.tags_out.emplace("reverse.im/filehost", ClientProtocol::MessageTagData(&filetag, metadata));
+
+        ServerInstance->Logs.Debug(MODNAME, "Added tag to message with URL: {}", url);
         return MOD_RES_PASSTHRU;
     }
     
@@ -497,4 +1039,15 @@ class ModuleFileHost : public Module, public ISupport::EventListener, public Cap
     }
 };
 
+void MetadataFetcher::OnNotify()
+{
+    LockQueue();
+    std::vector<Result> done;
+    done.swap(results);
+    UnlockQueue();
+
+    for (auto& result : done)
+        mod->OnMetadata(result);
+}
+
 MODULE_INIT(ModuleFileHost)
@@ -19,7 +19,7 @@
 /// $ModAuthor: reverse mike.chevronnet@gmail.com
 /// $ModDesc: Provides support for KiwiIRC-specific tags
 /// $ModDepends: core 4
-/// $ModConfig: <kiwiirctags enablefileupload="yes" enableconference="yes" enabletictactoe="yes" logusage="no" maxuploadsize="10M" restrictconferenceto="oper" notifychannelops="yes" notificationformat="%source% is using %tagtype% in %channel%">
+/// $ModConfig: <kiwiirctags enablefileupload="yes" enableconference="yes" enabletictactoe="yes" logusage="no" maxuploadsize="10M" restrictconferenceto="oper" notifychannelops="yes" notificationwindow="10s" notificationformat="%source% is using %tagtype% in %channel%">
 
 #include "inspircd.h"
 #include "extension.h"          // For ExtensionType::USER
@@ -27,6 +27,102 @@
 #include "modules/ctctags.h"
 #include "modules/stats.h"
 #include "timeutils.h"
+#include "hooklatency.h"
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+// The KiwiIRC tags we handle, interned to small IDs so each tag on a message
+// is looked up once and everything else indexes arrays.
+namespace KiwiTags
+{
+    enum ID : uint8_t
+    {
+        FILEUPLOAD,
+        CONFERENCE,
+        TICTACTOE_OLD,
+        TICTACTOE,
+        COUNT
+    };
+
+    // Who may send a tag.
+    enum class Restriction : uint8_t
+    {
+        NONE,
+        OPER,
+        ADMIN
+    };
+
+    struct Info
+    {
+        std::string_view name;
+        ID id;
+        const char* feature;
+    };
+
+    constexpr Info info[COUNT] = {
+        { "+kiwiirc.com/fileuploader", FILEUPLOAD, "file upload" },
+        { "+kiwiirc.com/conference", CONFERENCE, "conference" },
+        { "+data", TICTACTOE_OLD, "game" },
+        { "+kiwiirc.com/ttt", TICTACTOE, "game" },
+    };
+
+    // The names all have different lengths modulo the table size, which
+    // makes the length alone a perfect hash.
+    constexpr size_t TABLE_SIZE = 8;
+
+    constexpr size_t Slot(std::string_view name)
+    {
+        return name.size() % TABLE_SIZE;
+    }
+
+    constexpr std::array<ID, TABLE_SIZE> BuildTable()
+    {
+        std::array<ID, TABLE_SIZE> table = { };
+        for (auto& slot : table)
+            slot = COUNT;
+        for (const auto& entry : info)
+            table[Slot(entry.name)] = entry.id;
+        return table;
+    }
+
+    constexpr bool IsPerfect()
+    {
+        for (size_t i = 0; i < COUNT; ++i)
+        {
+            if (info[i].id != i)
+                return false;
+            for (size_t j = i + 1; j < COUNT; ++j)
+                if (Slot(info[i].name) == Slot(info[j].name))
+                    return false;
+        }
+        return true;
+    }
+
+    static_assert(IsPerfect(), "KiwiTags::Slot must map every tag to its own slot");
+
+    constexpr auto table = BuildTable();
+
+    // Returns the ID of a tag name or COUNT if it is not one of ours.
+    constexpr ID Lookup(std::string_view name)
+    {
+        const ID id = table[Slot(name)];
+        return id != COUNT && info[id].name == name ? id : COUNT;
+    }
+
+    inline Restriction ParseRestriction(const std::string& value)
+    {
+        if (irc::equals(value, "oper"))
+            return Restriction::OPER;
+        if (irc::equals(value, "admin"))
+            return Restriction::ADMIN;
+        return Restriction::NONE;
+    }
+}
 
 // Feature tracking extension item
 class TagUsageExtItem : public ExtensionItem
@@ -34,13 +130,36 @@ class TagUsageExtItem : public ExtensionItem
 public:
     struct TagStats
     {
-        unsigned long fileupload_count = 0;
-        unsigned long conference_count = 0;
-        unsigned long tictactoe_count = 0;
+        std::array<unsigned long, KiwiTags::COUNT> counts = { };
         time_t first_seen = 0;
         time_t last_seen = 0;
+
+        unsigned long Total() const
+        {
+            unsigned long total = 0;
+            for (unsigned long count : counts)
+                total += count;
+            return total;
+        }
+
+        unsigned long Games() const
+        {
+            return counts[KiwiTags::TICTACTOE_OLD] + counts[KiwiTags::TICTACTOE];
+        }
     };
 
+    // Module-wide counters per tag, kept up to date as tags are used so
+    // reporting them never has to walk the user list.
+    using Totals = std::array<unsigned long, KiwiTags::COUNT>;
+
+private:
+    Totals totals = { };
+
+    // Users which have a TagStats record.
+    std::unordered_set<User*> active;
+
+public:
+
     TagUsageExtItem(Module* mod) 
         : ExtensionItem(mod, "kiwiirc_tag_usage", ExtensionType::USER) 
     {
@@ -57,124 +176,220 @@ public:
         return "";
     }
 
-    TagStats* Get(User* user)
+    // Returns the stats of a user without creating them.
+    TagStats* Find(const User* user) const
     {
-        TagStats* stats = static_cast<TagStats*>(GetRaw(user));
+        return static_cast<TagStats*>(GetRaw(user));
+    }
+
+    TagStats* GetOrCreate(User* user)
+    {
+        TagStats* stats = Find(user);
         if (!stats)
         {
             stats = new TagStats;
             stats->first_seen = ServerInstance->Time();
             SetRaw(user, stats);
+            active.insert(user);
         }
         return stats;
     }
 
-    void UpdateStats(User* user, const std::string& tagname)
+    const Totals& GetTotals() const { return totals; }
+    const std::unordered_set<User*>& GetActive() const { return active; }
+
+    void UpdateStats(User* user, KiwiTags::ID id)
     {
-        TagStats* stats = Get(user);
+        TagStats* stats = GetOrCreate(user);
         stats->last_seen = ServerInstance->Time();
-
-        if (tagname == "+kiwiirc.com/fileuploader")
-            stats->fileupload_count++;
-        else if (tagname == "+kiwiirc.com/conference")
-            stats->conference_count++;
-        else if (tagname == "+data" || tagname == "+kiwiirc.com/ttt")
-            stats->tictactoe_count++;
+        stats->counts[id]++;
+        totals[id]++;
     }
 
-    std::string FormatStats(TagStats* stats) const
+    std::string FormatStats(const TagStats* stats) const
     {
         std::string result = "First seen: " + 
                             Time::ToString(stats->first_seen) +
                             ", Last seen: " +
                             Time::ToString(stats->last_seen) +
                             ", Usage counts: Uploads: " +
-                            ConvToStr(stats->fileupload_count) +
+                            ConvToStr(stats->counts[KiwiTags::FILEUPLOAD]) +
                             ", Conferences: " +
-                            ConvToStr(stats->conference_count) +
+                            ConvToStr(stats->counts[KiwiTags::CONFERENCE]) +
                             ", Games: " +
-                            ConvToStr(stats->tictactoe_count);
+                            ConvToStr(stats->Games());
         return result;
     }
 
     void Delete(Extensible* container, void* item) override
     {
+        active.erase(static_cast<User*>(container));
         delete static_cast<TagStats*>(item);
     }
 };
 
+// Lists the heaviest users of KiwiIRC tags a page at a time.
+class CommandKiwiStats final
+    : public Command
+{
+private:
+    TagUsageExtItem& tag_stats;
+
+public:
+    CommandKiwiStats(Module* mod, TagUsageExtItem& stats)
+        : Command(mod, "KIWISTATS", 0, 2)
+        , tag_stats(stats)
+    {
+        access_needed = CmdAccess::OPERATOR;
+        syntax.push_back("[<count>] [<page>]");
+    }
+
+    CmdResult Handle(User* user, const Params& parameters) override
+    {
+        const size_t count = parameters.size() > 0 ? std::clamp<size_t>(ConvToNum<size_t>(parameters[0]), 1, 100) : 20;
+        const size_t page = parameters.size() > 1 ? std::max<size_t>(ConvToNum<size_t>(parameters[1]), 1) : 1;
+
+        using Entry = std::pair<User*, const TagUsageExtItem::TagStats*>;
+        std::vector<Entry> entries;
+        entries.reserve(tag_stats.GetActive().size());
+        for (User* active : tag_stats.GetActive())
+        {
+            const TagUsageExtItem::TagStats* stats = tag_stats.Find(active);
+            if (stats && stats->Total())
+                entries.emplace_back(active, stats);
+        }
+
+        const size_t first = (page - 1) * count;
+        if (first >= entries.size())
+        {
+            user->WriteNotice("*** KIWISTATS: No users on page " + ConvToStr(page) + " (" + ConvToStr(entries.size()) + " active users).");
+            return CmdResult::SUCCESS;
+        }
+
+        // Only the entries up to the end of the requested page need sorting.
+        const size_t last = std::min(first + count, entries.size());
+        std::partial_sort(entries.begin(), entries.begin() + last, entries.end(), [](const Entry& a, const Entry& b)
+        {
+            const unsigned long atotal = a.second->Total();
+            const unsigned long btotal = b.second->Total();
+            return atotal != btotal ? atotal > btotal : a.first->nick < b.first->nick;
+        });
+
+        user->WriteNotice("*** KIWISTATS: Top KiwiIRC tag users " + ConvToStr(first + 1) + "-" + ConvToStr(last) + " of " + ConvToStr(entries.size()) + ":");
+        for (size_t i = first; i < last; ++i)
+            user->WriteNotice("*** " + ConvToStr(i + 1) + ". " + entries[i].first->nick + ": " + tag_stats.FormatStats(entries[i].second));
+
+        if (last < entries.size())
+            user->WriteNotice("*** KIWISTATS: Use /KIWISTATS " + ConvToStr(count) + " " + ConvToStr(page + 1) + " for the next page.");
+        return CmdResult::SUCCESS;
+    }
+};
+
+// A single provider for all of the KiwiIRC tags.
 class KiwiIRCTagProvider final
     : public ClientProtocol::MessageTagProvider
 {
 private:
-    std::string tagname;
-    Cap::Capability messagetags;
-    bool enabled;
-    std::string restriction;
+    Cap::Reference messagetags;
+    std::array<bool, KiwiTags::COUNT> enabled;
+    std::array<KiwiTags::Restriction, KiwiTags::COUNT> restriction;
     TagUsageExtItem& stats_ext;
     
 public:
-    KiwiIRCTagProvider(Module* mod, const std::string& tag, bool enabled_by_default, const std::string& restrict_to, TagUsageExtItem& stats)
+    KiwiIRCTagProvider(Module* mod, TagUsageExtItem& stats)
         : ClientProtocol::MessageTagProvider(mod)
-        , tagname(tag)
         , messagetags(mod, "message-tags")
-        , enabled(enabled_by_default)
-        , restriction(restrict_to)
         , stats_ext(stats)
     {
+        enabled.fill(true);
+        restriction.fill(KiwiTags::Restriction::NONE);
     }
 
-    void SetEnabled(bool new_state) { enabled = new_state; }
-    bool IsEnabled() const { return enabled; }
-    void SetRestriction(const std::string& restrict_to) { restriction = restrict_to; }
+    void SetEnabled(KiwiTags::ID id, bool new_state) { enabled[id] = new_state; }
+    bool IsEnabled(KiwiTags::ID id) const { return enabled[id]; }
+    void SetRestriction(KiwiTags::ID id, KiwiTags::Restriction restrict_to) { restriction[id] = restrict_to; }
 
     ModResult OnProcessTag(User* user, const std::string& name, std::string& value) override
     {
-        if (name == tagname)
+        const KiwiTags::ID id = KiwiTags::Lookup(name);
+        if (id == KiwiTags::COUNT)
+            return MOD_RES_PASSTHRU;
+
+        if (!enabled[id])
+            return MOD_RES_DENY;
+
+        // Check restrictions
+        switch (restriction[id])
         {
-            if (!enabled)
-                return MOD_RES_DENY;
-                
-            // Check restrictions
-            if (!restriction.empty())
-            {
-                if (restriction == "oper" && !user->IsOper())
+            case KiwiTags::Restriction::OPER:
+                if (!user->IsOper())
                     return MOD_RES_DENY;
-                    
-                if (restriction == "admin" && (!user->IsOper() || !user->HasPrivPermission("admin")))
+                break;
+
+            case KiwiTags::Restriction::ADMIN:
+                if (!user->IsOper() || !user->HasPrivPermission("admin"))
                     return MOD_RES_DENY;
-            }
-            
-            // Track usage statistics
-            stats_ext.UpdateStats(user, name);
-            
-            return MOD_RES_ALLOW;
+                break;
+
+            case KiwiTags::Restriction::NONE:
+                break;
         }
-        
-        return MOD_RES_PASSTHRU;
+
+        // Track usage statistics
+        stats_ext.UpdateStats(user, id);
+        return MOD_RES_ALLOW;
     }
 
     bool ShouldSendTag(LocalUser* user, const ClientProtocol::MessageTagData& tagdata) override
     {
-        return enabled && messagetags.IsEnabled(user);
+        // Disabled tags are already rejected by OnProcessTag.
+        return messagetags.IsEnabled(user);
+    }
+};
+
+class ModuleKiwiIRCTags;
+
+// Flushes the channel operator notifications queued during a window.
+class NotificationTimer final
+    : public Timer
+{
+private:
+    ModuleKiwiIRCTags* const mod;
+
+public:
+    NotificationTimer(ModuleKiwiIRCTags* m, unsigned long window)
+        : Timer(window, true)
+        , mod(m)
+    {
     }
+
+    bool Tick() override;
 };
 
 class ModuleKiwiIRCTags final
     : public Module, public Stats::EventListener
 {
 private:
-    const std::string file_uploader_tag = "+kiwiirc.com/fileuploader";
-    const std::string conference_tag = "+kiwiirc.com/conference";
-    const std::string tictactoe_old_tag = "+data";
-    const std::string tictactoe_tag = "+kiwiirc.com/ttt";
-
-    KiwiIRCTagProvider file_uploader_provider;
-    KiwiIRCTagProvider conference_provider;
-    KiwiIRCTagProvider tictactoe_old_provider;
-    KiwiIRCTagProvider tictactoe_provider;
-    
+    // Tag usage in a channel since the last notification flush.
+    struct PendingUse
+    {
+        std::string nick;
+        const char* feature;
+        unsigned long count;
+    };
+
+    // The most users listed in a single summary notice.
+    static constexpr size_t MAX_SUMMARY_ENTRIES = 10;
+
+    std::unordered_map<std::string, std::vector<PendingUse>> pending_notifications;
+    std::unique_ptr<NotificationTimer> notification_timer;
+    unsigned long notification_window = 0;
+
     TagUsageExtItem tag_stats;
+    KiwiIRCTagProvider tag_provider;
+    CommandKiwiStats cmd_stats;
+    Latency::Monitor latency;
+    Latency::Histogram& premessage_latency;
     
     // Configuration options
     bool log_usage;
@@ -187,10 +402,10 @@ public:
         : Module(VF_VENDOR, "Provides support for KiwiIRC-specific tags")
         , Stats::EventListener(this)
         , tag_stats(this)
-        , file_uploader_provider(this, file_uploader_tag, true, "", tag_stats)
-        , conference_provider(this, conference_tag, true, "", tag_stats)
-        , tictactoe_old_provider(this, tictactoe_old_tag, true, "", tag_stats)
-        , tictactoe_provider(this, tictactoe_tag, true, "", tag_stats)
+        , tag_provider(this, tag_stats)
+        , cmd_stats(this, tag_stats)
+        , latency(this, "kiwiirctags")
+        , premessage_latency(latency.Add("OnUserPreMessage"))
         , log_usage(false)
         , max_upload_size("10M")
         , notify_channel_ops(false)
@@ -198,23 +413,74 @@ public:
     {
     }
 
+    ~ModuleKiwiIRCTags() override
+    {
+        if (notification_timer)
+            ServerInstance->Timers.DelTimer(notification_timer.get());
+    }
+
+    // Send each channel operator one summary of the tag usage queued since
+    // the last flush.
+    void FlushNotifications()
+    {
+        for (const auto& [channame, uses] : pending_notifications)
+        {
+            Channel* chan = ServerInstance->Channels.Find(channame);
+            if (!chan)
+                continue;
+
+            std::string summary = "*** KiwiIRC activity in " + chan->name + ": ";
+            for (size_t i = 0; i < uses.size() && i < MAX_SUMMARY_ENTRIES; ++i)
+            {
+                if (i)
+                    summary.append(", ");
+                summary.append(uses[i].nick).append(" used ").append(uses[i].feature).append(" \u00d7").append(ConvToStr(uses[i].count));
+            }
+            if (uses.size() > MAX_SUMMARY_ENTRIES)
+                summary.append(" and ").append(ConvToStr(uses.size() - MAX_SUMMARY_ENTRIES)).append(" more");
+            summary.append(" in the last ").append(Duration::ToString(notification_window));
+
+            for (const auto& [member, _] : chan->GetPrefixUsers())
+            {
+                if (member->HasMode('o') || member->HasMode('a'))
+                    member->WriteNotice(summary);
+            }
+        }
+        pending_notifications.clear();
+    }
+
+    void QueueNotification(Channel* chan, User* user, const char* feature)
+    {
+        auto& uses = pending_notifications[chan->name];
+        for (auto& use : uses)
+        {
+            if (use.feature == feature && use.nick == user->nick)
+            {
+                use.count++;
+                return;
+            }
+        }
+        uses.push_back({ user->nick, feature, 1 });
+    }
+
     void ReadConfig(ConfigStatus& status) override
     {
+        latency.ReadConfig();
         const auto& tag = ServerInstance->Config->ConfValue("kiwiirctags");
         
         // Feature toggles
-        file_uploader_provider.SetEnabled(tag->getBool("enablefileupload", true));
-        conference_provider.SetEnabled(tag->getBool("enableconference", true));
+        tag_provider.SetEnabled(KiwiTags::FILEUPLOAD, tag->getBool("enablefileupload", true));
+        tag_provider.SetEnabled(KiwiTags::CONFERENCE, tag->getBool("enableconference", true));
         bool enable_tictactoe = tag->getBool("enabletictactoe", true);
-        tictactoe_old_provider.SetEnabled(enable_tictactoe);
-        tictactoe_provider.SetEnabled(enable_tictactoe);
+        tag_provider.SetEnabled(KiwiTags::TICTACTOE_OLD, enable_tictactoe);
+        tag_provider.SetEnabled(KiwiTags::TICTACTOE, enable_tictactoe);
         
         // Restrictions
-        file_uploader_provider.SetRestriction(tag->getString("restrictuploadto", ""));
-        conference_provider.SetRestriction(tag->getString("restrictconferenceto", ""));
-        std::string ttt_restriction = tag->getString("restricttictactoeto", "");
-        tictactoe_old_provider.SetRestriction(ttt_restriction);
-        tictactoe_provider.SetRestriction(ttt_restriction);
+        tag_provider.SetRestriction(KiwiTags::FILEUPLOAD, KiwiTags::ParseRestriction(tag->getString("restrictuploadto", "")));
+        tag_provider.SetRestriction(KiwiTags::CONFERENCE, KiwiTags::ParseRestriction(tag->getString("restrictconferenceto", "")));
+        const KiwiTags::Restriction ttt_restriction = KiwiTags::ParseRestriction(tag->getString("restricttictactoeto", ""));
+        tag_provider.SetRestriction(KiwiTags::TICTACTOE_OLD, ttt_restriction);
+        tag_provider.SetRestriction(KiwiTags::TICTACTOE, ttt_restriction);
         
         // Other options
         log_usage = tag->getBool("logusage", false);
@@ -222,32 +488,77 @@ public:
         notify_channel_ops = tag->getBool("notifychannelops", false);
         notification_format = tag->getString("notificationformat", 
                                             "%source% is using %tagtype% in %channel%");
+
+        // Coalesce channel operator notifications over this window, or
+        // send one for every message if it is zero.
+        const unsigned long new_window = tag->getDuration("notificationwindow", 10, 0, 3600);
+        if (new_window != notification_window || !notify_channel_ops)
+            FlushNotifications();
+        notification_window = new_window;
+
+        if (notification_window && notify_channel_ops)
+        {
+            if (!notification_timer)
+            {
+                notification_timer = std::make_unique<NotificationTimer>(this, notification_window);
+                ServerInstance->Timers.AddTimer(notification_timer.get());
+            }
+            else
+                notification_timer->SetInterval(notification_window);
+        }
+        else if (notification_timer)
+        {
+            ServerInstance->Timers.DelTimer(notification_timer.get());
+            notification_timer.reset();
+        }
     }
 
-    // Fixed method signature for InspIRCd v4
-    ModResult OnUserPreMessage(User* user, const MessageTarget& target, MessageDetails& details) override
+    ModResult OnUserPreMessage(User* user, MessageTarget& target, MessageDetails& details) override
     {
-        if (!details.tags_out.empty() && notify_channel_ops && target.type == MessageTarget::TYPE_CHANNEL)
+        Latency::ScopedTimer latencytimer(premessage_latency);
+        if (details.tags_out.empty() || (!notify_channel_ops && !log_usage))
+            return MOD_RES_PASSTHRU;
+
+        // Find our tags in a single pass over the message's tags. Only tags
+        // which we accepted in OnProcessTag carry our provider.
+        const std::string* first_tag = nullptr;
+        KiwiTags::ID first_id = KiwiTags::COUNT;
+        for (const auto& [tagname, tagdata] : details.tags_out)
+        {
+            if (tagdata.provider != &tag_provider)
+                continue;
+
+            const KiwiTags::ID id = KiwiTags::Lookup(tagname);
+            if (id == KiwiTags::COUNT)
+                continue;
+
+            // The first of our tags in priority order decides how the message
+            // is described to channel operators.
+            if (id < first_id)
+            {
+                first_tag = &tagname;
+                first_id = id;
+            }
+        }
+
+        if (first_id == KiwiTags::COUNT)
+            return MOD_RES_PASSTHRU;
+
+        const char* feature = KiwiTags::info[first_id].feature;
+
+        if (notify_channel_ops && target.type == MessageTarget::TYPE_CHANNEL)
         {
             Channel* chan = target.Get<Channel>();
-            
-            // Detect which tag is being used
-            std::string tag_type;
-            if (details.tags_out.find(file_uploader_tag) != details.tags_out.end())
-                tag_type = "file upload";
-            else if (details.tags_out.find(conference_tag) != details.tags_out.end())
-                tag_type = "conference";
-            else if (details.tags_out.find(tictactoe_old_tag) != details.tags_out.end() || 
-                     details.tags_out.find(tictactoe_tag) != details.tags_out.end())
-                tag_type = "game";
-            
-            // If a KiwiIRC tag was found
-            if (!tag_type.empty())
+            if (notification_window)
+            {
+                QueueNotification(chan, user, feature);
+            }
+            else
             {
                 // Create notification for channel operators
                 std::string notification = notification_format;
                 strlreplace(notification, "%source%", user->nick);
-                strlreplace(notification, "%tagtype%", tag_type);
+                strlreplace(notification, "%tagtype%", feature);
                 strlreplace(notification, "%channel%", chan->name);
                 
                 // Send notice to channel operators
@@ -262,65 +573,36 @@ public:
         }
         
         // Log usage if enabled
-        if (log_usage && !details.tags_out.empty())
-        {
-            for (const auto& [tagname, _] : details.tags_out)
-            {
-                if (tagname == file_uploader_tag || 
-                    tagname == conference_tag || 
-                    tagname == tictactoe_old_tag || 
-                    tagname == tictactoe_tag)
-                {
-                    ServerInstance->Logs.Log("MODULE", LOG_DEFAULT, 
-                                           "KiwiIRC tag '%s' used by %s", 
-                                           tagname.c_str(), user->GetFullHost().c_str());
-                    break;
-                }
-            }
-        }
+        if (log_usage)
+            ServerInstance->Logs.Normal(MODNAME, "KiwiIRC tag '{}' used by {}", *first_tag, user->GetFullHost());
         
         return MOD_RES_PASSTHRU;
     }
 
     // Stats reporting
-    bool OnStats(Stats::Context& stats) override
+    ModResult OnStats(Stats::Context& stats) override
     {
         if (stats.GetSymbol() == 'K')
         {
             stats.AddRow(998, "KiwiIRC Tags Module:");
-            stats.AddRow(998, "  File Upload: " + std::string(file_uploader_provider.IsEnabled() ? "enabled" : "disabled"));
-            stats.AddRow(998, "  Conference: " + std::string(conference_provider.IsEnabled() ? "enabled" : "disabled"));
-            stats.AddRow(998, "  Tic-Tac-Toe: " + std::string(tictactoe_provider.IsEnabled() ? "enabled" : "disabled"));
+            stats.AddRow(998, "  File Upload: " + std::string(tag_provider.IsEnabled(KiwiTags::FILEUPLOAD) ? "enabled" : "disabled"));
+            stats.AddRow(998, "  Conference: " + std::string(tag_provider.IsEnabled(KiwiTags::CONFERENCE) ? "enabled" : "disabled"));
+            stats.AddRow(998, "  Tic-Tac-Toe: " + std::string(tag_provider.IsEnabled(KiwiTags::TICTACTOE) ? "enabled" : "disabled"));
             stats.AddRow(998, "  Max Upload Size: " + max_upload_size);
             
-            unsigned long total_users = 0;
-            unsigned long total_uploads = 0;
-            unsigned long total_conferences = 0;
-            unsigned long total_games = 0;
+            // Per-user listings are opt-in through /KIWISTATS.
+            const TagUsageExtItem::Totals& totals = tag_stats.GetTotals();
+            stats.AddRow(998, "  Total active users: " + ConvToStr(tag_stats.GetActive().size()));
+            stats.AddRow(998, "  Total uploads: " + ConvToStr(totals[KiwiTags::FILEUPLOAD]));
+            stats.AddRow(998, "  Total conferences: " + ConvToStr(totals[KiwiTags::CONFERENCE]));
+            stats.AddRow(998, "  Total games: " + ConvToStr(totals[KiwiTags::TICTACTOE_OLD] + totals[KiwiTags::TICTACTOE])
+                + " (+kiwiirc.com/ttt: " + ConvToStr(totals[KiwiTags::TICTACTOE]) + ", +data: " + ConvToStr(totals[KiwiTags::TICTACTOE_OLD]) + ")");
+            stats.AddRow(998, "  Use /KIWISTATS [<count>] [<page>] for the most active users.");
             
-            for (auto* user : ServerInstance->Users.GetLocalUsers())
-            {
-                auto* userstats = tag_stats.Get(user);
-                if (userstats->fileupload_count || userstats->conference_count || userstats->tictactoe_count)
-                {
-                    total_users++;
-                    total_uploads += userstats->fileupload_count;
-                    total_conferences += userstats->conference_count;
-                    total_games += userstats->tictactoe_count;
-                    
-                    stats.AddRow(999, user->nick + ": " + tag_stats.FormatStats(userstats));
-                }
-            }
-            
-            stats.AddRow(998, "  Total active users: " + ConvToStr(total_users));
-            stats.AddRow(998, "  Total uploads: " + ConvToStr(total_uploads));
-            stats.AddRow(998, "  Total conferences: " + ConvToStr(total_conferences));
-            stats.AddRow(998, "  Total games: " + ConvToStr(total_games));
-            
-            return true;
+            return MOD_RES_DENY;
         }
         
-        return false;
+        return MOD_RES_PASSTHRU;
     }
 
     void OnOperRejoin(User* user, Channel* channel) override
@@ -333,8 +615,8 @@ public:
             
             for (const auto& [member, _] : channel->GetUsers())
             {
-                TagUsageExtItem::TagStats* stats = tag_stats.Get(member);
-                if (stats && (stats->fileupload_count || stats->conference_count || stats->tictactoe_count))
+                const TagUsageExtItem::TagStats* stats = tag_stats.Find(member);
+                if (stats && stats->Total())
                 {
                     user_count++;
                 }
@@ -358,4 +640,10 @@ public:
     }
 };
 
+bool NotificationTimer::Tick()
+{
+    mod->FlushNotifications();
+    return true;
+}
+
 MODULE_INIT(ModuleKiwiIRCTags)
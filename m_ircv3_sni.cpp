@@ -20,41 +20,108 @@
 #include "modules/ssl.h"
 #include "modules/whois.h"
 #include "modules/server.h"
+#include "modules/stats.h"
 #include "extension.h"
+#include "whoisextras.h"
+#include <memory>
+#include <unordered_map>
+
+// The network metadata key used to burst SNI hostnames, as "<hostname> <uuid>+".
+static const std::string BURST_KEY = "sni_users";
+
+// Interned SNI hostnames. There are only ever a handful of distinct names so
+// users share one refcounted entry each instead of holding their own copy;
+// the refcount doubles as the number of users using the name.
+class SNIPool final
+{
+public:
+	struct Entry final
+	{
+		const std::string hostname;
+		size_t refcount = 0;
+
+		Entry(const std::string& name)
+			: hostname(name)
+		{
+		}
+	};
+
+private:
+	std::unordered_map<std::string, std::unique_ptr<Entry>> entries;
+
+public:
+	// Returns the entry for a hostname with a new reference taken on it.
+	Entry* Acquire(const std::string& hostname)
+	{
+		auto& entry = entries[hostname];
+		if (!entry)
+			entry = std::make_unique<Entry>(hostname);
+
+		entry->refcount++;
+		return entry.get();
+	}
+
+	void Release(Entry* entry)
+	{
+		if (--entry->refcount)
+			return;
+
+		auto it = entries.find(entry->hostname);
+		if (it != entries.end())
+			entries.erase(it);
+	}
+
+	const std::unordered_map<std::string, std::unique_ptr<Entry>>& GetEntries() const
+	{
+		return entries;
+	}
+};
 
 class SNIExtension final
 	: public ExtensionItem
 {
+private:
+	SNIPool& pool;
+
 public:
-	SNIExtension(Module* parent)
+	SNIExtension(Module* parent, SNIPool& p)
 		: ExtensionItem(parent, "sni_hostname", ExtensionType::USER)
+		, pool(p)
 	{
 	}
 
-	std::string* Get(const User* user) const
+	const std::string* Get(const User* user) const
 	{
-		return static_cast<std::string*>(GetRaw(user));
+		auto* entry = static_cast<SNIPool::Entry*>(GetRaw(user));
+		return entry ? &entry->hostname : nullptr;
 	}
 
-	void Set(User* user, std::string* value, bool sync = true)
+	SNIPool::Entry* GetEntry(const User* user) const
 	{
-		std::string* old = static_cast<std::string*>(SetRaw(user, value));
+		return static_cast<SNIPool::Entry*>(GetRaw(user));
+	}
+
+	void Set(User* user, const std::string& hostname, bool sync = true)
+	{
+		SNIPool::Entry* old = static_cast<SNIPool::Entry*>(SetRaw(user, pool.Acquire(hostname)));
 		if (old)
-			delete old;
+			pool.Release(old);
 
+		// Only new connections are sent one by one. Users which already exist
+		// when a server links are sent in bulk by OnSyncNetwork instead.
 		if (sync)
-			Sync(user, value);
+			ServerInstance->PI->SendMetadata(user, name, hostname);
 	}
 
 	std::string ToInternal(const Extensible* container, void* item) const noexcept override
 	{
-		return ToNetwork(container, item);
+		return static_cast<SNIPool::Entry*>(item)->hostname;
 	}
 
 	std::string ToNetwork(const Extensible* container, void* item) const noexcept override
 	{
-		std::string* hostname = static_cast<std::string*>(item);
-		return *hostname;
+		// Not sent in the per-user burst; see Set.
+		return std::string();
 	}
 
 	void FromInternal(Extensible* container, const std::string& value) noexcept override
@@ -64,37 +131,43 @@ public:
 
 	void FromNetwork(Extensible* container, const std::string& value) noexcept override
 	{
-		if (container->extype != this->extype)
+		if (container->extype != this->extype || value.empty())
 			return;
 
-		auto* hostname = new std::string(value);
-		Set(static_cast<User*>(container), hostname, false);
+		Set(static_cast<User*>(container), value, false);
 	}
 
 	void Delete(Extensible* container, void* item) override
 	{
-		std::string* hostname = static_cast<std::string*>(item);
-		if (hostname)
-			delete hostname;
+		if (item)
+			pool.Release(static_cast<SNIPool::Entry*>(item));
 	}
 };
 
 class ModuleIRCv3SNI final
 	: public Module
 	, public ServerProtocol::LinkEventListener
+	, public ServerProtocol::SyncEventListener
+	, public Stats::EventListener
 	, public Whois::EventListener
 {
 private:
+	SNIPool pool;
 	SNIExtension sniext;
+	WhoisExtras::Cache whois_cache;
 	bool announcesni;
 	char snomask;
+	char stats_symbol;
 
 public:
 	ModuleIRCv3SNI()
 		: Module(VF_VENDOR | VF_OPTCOMMON, "Adds support for TLS Server Name Indication (SNI) which allows servers to present different certificates based on the hostname the client is connecting to.")
 		, ServerProtocol::LinkEventListener(this)
+		, ServerProtocol::SyncEventListener(this)
+		, Stats::EventListener(this)
 		, Whois::EventListener(this)
-		, sniext(this)
+		, sniext(this, pool)
+		, whois_cache(this, WhoisExtras::SNI)
 		, announcesni(false)
 		, snomask('a')
 	{
@@ -111,6 +184,8 @@ public:
 		
 		if (snomask < 'a' || snomask > 'z')
 			snomask = 'a';
+
+		stats_symbol = tag->getString("statssymbol", "N", 1, 1)[0];
 	}
 
 	void OnPostConnect(User* user) override
@@ -120,6 +195,9 @@ public:
 		if (!localuser)
 			return;
 
+		// This is a new TLS session so anything we had cached is out of date.
+		whois_cache.Invalidate(user);
+
 		SSLIOHook* sslhook = SSLIOHook::IsSSL(&localuser->eh);
 		if (!sslhook)
 			return;
@@ -127,8 +205,7 @@ public:
 		std::string hostname;
 		if (sslhook->GetServerName(hostname) && !hostname.empty())
 		{
-			auto* stored_hostname = new std::string(hostname);
-			sniext.Set(user, stored_hostname);
+			sniext.Set(user, hostname);
 			
 			if (announcesni)
 			{
@@ -150,12 +227,70 @@ public:
 		if (!source->HasPrivPermission("users/auspex"))
 			return;
 
-		std::string* sni_hostname = sniext.Get(target);
+		const std::string* sni_hostname = sniext.Get(target);
 		if (sni_hostname)
 		{
 			// Send the SNI hostname information in the WHOIS response
-			whois.SendLine(RPL_WHOISSPECIAL,"*", "is using SNI with hostname " + *sni_hostname);
+			whois.SendLine(RPL_WHOISSPECIAL, "*", whois_cache.Get(target, *sni_hostname, [](const std::string& hostname) {
+				return "is using SNI with hostname " + hostname;
+			}));
+		}
+	}
+
+	void OnSyncNetwork(ProtocolServer& server) override
+	{
+		// Group the users by hostname so each name is only sent once per link.
+		std::unordered_map<SNIPool::Entry*, std::vector<std::string>> users;
+		for (const auto& [_, user] : ServerInstance->Users.GetUsers())
+		{
+			SNIPool::Entry* entry = sniext.GetEntry(user);
+			if (entry)
+				users[entry].push_back(user->uuid);
 		}
+
+		for (const auto& [entry, uuids] : users)
+		{
+			std::string line = entry->hostname;
+			for (const auto& uuid : uuids)
+			{
+				// Keep each line well within the protocol limit.
+				if (line.length() + uuid.length() + 1 > 400)
+				{
+					server.SendMetadata(BURST_KEY, line);
+					line = entry->hostname;
+				}
+				line.append(1, ' ').append(uuid);
+			}
+			server.SendMetadata(BURST_KEY, line);
+		}
+	}
+
+	void OnDecodeMetadata(Extensible* target, const std::string& extname, const std::string& extdata) override
+	{
+		if (target || extname != BURST_KEY)
+			return;
+
+		irc::spacesepstream stream(extdata);
+		std::string hostname;
+		if (!stream.GetToken(hostname))
+			return;
+
+		for (std::string uuid; stream.GetToken(uuid); )
+		{
+			User* user = ServerInstance->Users.FindUUID(uuid);
+			if (user && !IS_LOCAL(user))
+				sniext.Set(user, hostname, false);
+		}
+	}
+
+	ModResult OnStats(Stats::Context& stats) override
+	{
+		if (stats.GetSymbol() != stats_symbol)
+			return MOD_RES_PASSTHRU;
+
+		for (const auto& [hostname, entry] : pool.GetEntries())
+			stats.AddRow(998, INSP_FORMAT("SNI {}: {} user(s)", hostname, entry->refcount));
+		return MOD_RES_DENY;
 	}
 };
 
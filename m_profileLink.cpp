@@ -24,6 +24,7 @@
 #include "inspircd.h"
 #include "modules/whois.h"
 #include "modules/account.h"
+#include "whoisextras.h"
 
 enum
 {
@@ -39,6 +40,7 @@ private:
 	Account::API accountapi;
 	std::string profileBaseUrl;
 	UserModeReference botmode;
+	WhoisExtras::Cache whois_cache;
 
 public:
 	ModuleProfileLink()
@@ -46,6 +48,7 @@ public:
 		, Whois::EventListener(this)
 		, accountapi(this)
 		, botmode(this, "bot")
+		, whois_cache(this, WhoisExtras::PROFILE)
 	{
 	}
 
@@ -53,6 +56,9 @@ public:
 	{
 		auto& tag = ServerInstance->Config->ConfValue("profilelink");
 		profileBaseUrl = tag->getString("baseurl");
+
+		// Links built with the old base URL are stale.
+		whois_cache.Reset();
 	}
 
 	void OnWhois(Whois::Context& whois) override
@@ -71,10 +77,10 @@ public:
 		const std::string* account = accountapi->GetAccountName(target);
 		if (account)
 		{
-			// Construct the profile URL using the user's account name.
-			const std::string profileUrl = profileBaseUrl + *account;
-			// Send the profile URL in the WHOIS response.
-			whois.SendLine(RPL_WHOISPROFILE, "*", "Profil: " + profileUrl);
+			// Send the profile URL in the WHOIS response. It is rebuilt only when the account changes.
+			whois.SendLine(RPL_WHOISPROFILE, "*", whois_cache.Get(target, *account, [this](const std::string& name) {
+				return "Profil: " + profileBaseUrl + name;
+			}));
 		}
 		else
 		{
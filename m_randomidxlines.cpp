@@ -19,22 +19,125 @@
 #include "inspircd.h"
 #include "xline.h"
 #include "timeutils.h"
-#include <random>
+#include <chrono>
+#include <unordered_map>
+
+// Suffix appended to the reason of every X-line we tag.
+static const std::string ID_MARKER = " - ID: ";
+
+// Where to find an X-line by its ID. The line itself is looked up again when
+// needed as the X-line manager may free it at any time.
+struct XLineRef final
+{
+    std::string type;
+    std::string mask;
+};
+
+typedef std::unordered_map<std::string, XLineRef, irc::insensitive, irc::StrHashComp> XLineIndex;
+
+class CommandXLineID final
+    : public Command
+{
+private:
+    XLineIndex& index;
+
+public:
+    CommandXLineID(Module* mod, XLineIndex& idx)
+        : Command(mod, "XLINEID", 1, 2)
+        , index(idx)
+    {
+        access_needed = CmdAccess::OPERATOR;
+        syntax.push_back("<id> [REMOVE]");
+    }
+
+    CmdResult Handle(User* user, const Params& parameters) override
+    {
+        auto it = index.find(parameters[0]);
+        XLine* line = nullptr;
+        if (it != index.end())
+        {
+            XLineLookup* lines = ServerInstance->XLines->GetAll(it->second.type);
+            if (lines)
+            {
+                auto lit = lines->find(it->second.mask);
+                if (lit != lines->end())
+                    line = lit->second;
+            }
+        }
+
+        if (!line)
+        {
+            user->WriteNotice("*** XLINEID: No X-line with the ID " + parameters[0] + " exists.");
+            return CmdResult::FAILURE;
+        }
+
+        const XLineRef ref = it->second;
+        if (parameters.size() > 1)
+        {
+            if (!irc::equals(parameters[1], "REMOVE"))
+            {
+                user->WriteNotice("*** XLINEID: Unknown option " + parameters[1] + ", expected REMOVE.");
+                return CmdResult::FAILURE;
+            }
+
+            std::string reason;
+            if (!ServerInstance->XLines->DelLine(ref.mask.c_str(), ref.type, reason, user))
+            {
+                user->WriteNotice("*** XLINEID: Unable to remove " + ref.type + "-line on " + ref.mask + ".");
+                return CmdResult::FAILURE;
+            }
+
+            ServerInstance->SNO.WriteToSnoMask('x', "{} removed {}-line on {} by ID {}: {}", user->nick, ref.type, ref.mask, parameters[0], reason);
+            user->WriteNotice("*** XLINEID: Removed " + ref.type + "-line on " + ref.mask + ".");
+            return CmdResult::SUCCESS;
+        }
+
+        user->WriteNotice(INSP_FORMAT("*** XLINEID: {} is a {}-line on {} set by {} on {}, {}: {}", parameters[0], ref.type, ref.mask,
+            line->source, Time::ToString(line->set_time),
+            line->duration ? "expiring on " + Time::ToString(line->expiry) : std::string("permanent"), line->reason));
+        return CmdResult::SUCCESS;
+    }
+};
 
 class ModuleRandomIDxLines : public Module
 {
 private:
-    std::string GenerateRandomID()
+    XLineIndex index;
+    CommandXLineID cmd;
+
+    // The last ID generated, used to keep IDs strictly increasing even if the clock goes backwards.
+    uint64_t last_id = 0;
+
+    /** Generates a snowflake-style ID: milliseconds since 2024-01-01 followed by a 12-bit
+     * sequence, prefixed with our SID so that IDs from different servers never collide.
+     */
+    std::string GenerateID()
     {
-        static std::random_device rd;
-        static std::mt19937 gen(rd());
-        static std::uniform_int_distribution<uint64_t> dis(1000000000, 9999999999);
-        return ConvToStr(dis(gen));
+        static constexpr uint64_t EPOCH = 1704067200000ULL;
+        const uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+
+        uint64_t id = ((now > EPOCH ? now - EPOCH : 0) << 12);
+        if (id <= last_id)
+            id = last_id + 1;
+        last_id = id;
+
+        static const char digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+        char buffer[16];
+        size_t pos = sizeof(buffer);
+        do
+        {
+            buffer[--pos] = digits[id % 36];
+            id /= 36;
+        }
+        while (id);
+
+        return ServerInstance->Config->GetSID() + std::string(buffer + pos, sizeof(buffer) - pos);
     }
 
     void AppendRandomID(std::string& message)
     {
-        std::string random_id = " - ID: " + GenerateRandomID();
+        std::string random_id = ID_MARKER + GenerateID();
         size_t max_reason_length = 510 - random_id.length();  // 510 to account for possible CR LF at the end
         if (message.length() > max_reason_length)
         {
@@ -43,6 +146,38 @@ private:
         message += random_id;
     }
 
+    // Returns the ID at the end of an X-line reason, or an empty string if it has none.
+    static std::string ExtractID(const std::string& reason)
+    {
+        size_t pos = reason.rfind(ID_MARKER);
+        if (pos == std::string::npos)
+            return std::string();
+
+        std::string id = reason.substr(pos + ID_MARKER.length());
+        if (id.empty() || id.find(' ') != std::string::npos)
+            return std::string();
+        return id;
+    }
+
+    void IndexLine(XLine* line)
+    {
+        const std::string id = ExtractID(line->reason);
+        if (!id.empty())
+            index[id] = { line->type, line->Displayable() };
+    }
+
+    void UnindexLine(XLine* line)
+    {
+        const std::string id = ExtractID(line->reason);
+        if (id.empty())
+            return;
+
+        // Only remove the entry if it still refers to this line.
+        auto it = index.find(id);
+        if (it != index.end() && it->second.type == line->type && irc::equals(it->second.mask, line->Displayable()))
+            index.erase(it);
+    }
+
     bool IsValidHostMask(const std::string& mask)
     {
         return mask.find('@') != std::string::npos || (mask.length() > 0 && mask[0] == '@');
@@ -55,13 +190,19 @@ private:
 
     bool XLineExists(const std::string& command, const std::string& target)
     {
+        std::string type;
         if (command == "ZLINE")
-            return ServerInstance->XLines->MatchesLine("Z", target) != nullptr;
+            type = "Z";
         else if (command == "GLINE")
-            return ServerInstance->XLines->MatchesLine("G", target) != nullptr;
+            type = "G";
         else if (command == "KLINE")
-            return ServerInstance->XLines->MatchesLine("K", target) != nullptr;
-        return false;
+            type = "K";
+        else
+            return false;
+
+        // Look for a line on exactly this mask rather than one which merely matches it.
+        XLineLookup* lines = ServerInstance->XLines->GetAll(type);
+        return lines && lines->find(target) != lines->end();
     }
 
     ModResult HandleLineCommand(const std::string& command, User* source, CommandBase::Params& parameters)
@@ -84,7 +225,37 @@ private:
 public:
     ModuleRandomIDxLines()
         : Module(VF_VENDOR, "Enhances /zline, /gline, /kline, /kill and similar commands by adding a random ID to the end for better log identification.")
+        , cmd(this, index)
+    {
+    }
+
+    void init() override
+    {
+        // Pick up lines which were added before we were loaded.
+        for (const auto& type : ServerInstance->XLines->GetAllTypes())
+        {
+            XLineLookup* lines = ServerInstance->XLines->GetAll(type);
+            if (!lines)
+                continue;
+
+            for (const auto& [_, line] : *lines)
+                IndexLine(line);
+        }
+    }
+
+    void OnAddLine(User* source, XLine* line) override
+    {
+        IndexLine(line);
+    }
+
+    void OnDelLine(User* source, XLine* line) override
+    {
+        UnindexLine(line);
+    }
+
+    void OnExpireLine(XLine* line) override
     {
+        UnindexLine(line);
     }
 
     ModResult OnPreCommand(std::string& command, CommandBase::Params& parameters, LocalUser* user, bool validated) override
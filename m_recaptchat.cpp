@@ -12,8 +12,10 @@
 /// $ModAuthor: reverse Chevronnet <mike.chevronnet@gmail.com>
 /// $ModDesc: Handles Google reCAPTCHA v2 verification via SQL and NickServ accounts.
 /// $ModConfig: url="https://recaptcha.vicio.chat/verify/" 
-///             dbid="default" query="SELECT COUNT(*) FROM recaptcha_app_verificationtoken WHERE token = $1 AND created_at + INTERVAL '30 minutes' > NOW()"
-///             whitelistchans="#help,#opers" whitelistports="6667,6697">
+///             dbid="default" query="SELECT COUNT(*) FROM recaptcha_app_verificationtoken WHERE token = ? AND created_at + INTERVAL '30 minutes' > NOW()"
+///             whitelistchans="#help,#opers" whitelistports="6667,6697"
+///             verifylimit="5" verifyperiod="1m" failcache="30s"
+///             tokenexpiry="30m" tokenpool="64">
 /// $ModDepends: core 4
 
 /// $LinkerFlags: -lcrypto
@@ -21,8 +23,13 @@
 #include "inspircd.h"
 #include "modules/sql.h"
 #include "extension.h"
+#include <openssl/rand.h>
 #include <openssl/sha.h> // For SHA256
 #include "modules/account.h"  // Add Account API
+#include <algorithm>
+#include <bitset>
+#include <unordered_map>
+#include <unordered_set>
 
 class ModuleCaptchaCheck; // Forward declaration
 
@@ -42,45 +49,86 @@ public:
     CmdResult Handle(User* user, const Params& parameters) override;
 };
 
-// SQL Query for token validation
-class ValidateTokenQuery final : public SQL::Query
+// A verification code and the hash sent alongside it, as lowercase hex.
+struct CaptchaToken final
 {
-private:
-    User* user;
-    BoolExtItem& captcha_verified;
+    static constexpr size_t RANDOM_BYTES = 32;
+    static constexpr size_t HEX_LENGTH = RANDOM_BYTES * 2;
 
-public:
-    ValidateTokenQuery(Module* Creator, User* User, BoolExtItem& CaptchaVerified)
-        : SQL::Query(Creator), user(User), captcha_verified(CaptchaVerified) {}
+    char token[HEX_LENGTH + 1];
+    char hash[SHA256_DIGEST_LENGTH * 2 + 1];
 
-    void OnResult(SQL::Result& result) override
+    static void ToHex(const unsigned char* data, size_t length, char* out)
     {
-        SQL::Row row;
-        if (result.GetRow(row))
-        {
-            const std::string count = row[0].value_or("0");
-            if (count == "1")
-            {
-                captcha_verified.Set(user, true);
-                user->WriteNotice("*** reCAPTCHA: Verification successful. You may now join channels.");
-            }
-            else
-            {
-                user->WriteNotice("*** reCAPTCHA: Verification failed. Token not found or expired.");
-            }
-        }
-        else
+        static const char hex_chars[] = "0123456789abcdef";
+        for (size_t i = 0; i < length; ++i)
         {
-            user->WriteNotice("*** reCAPTCHA: Verification failed. Token not found.");
+            out[i * 2] = hex_chars[data[i] >> 4];
+            out[i * 2 + 1] = hex_chars[data[i] & 0xf];
         }
+        out[length * 2] = '\0';
     }
 
-    void OnError(const SQL::Error& error) override
+    bool Generate()
     {
-        user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: SQL Error: {}", error.ToString()));
+        unsigned char random[RANDOM_BYTES];
+        if (RAND_bytes(random, sizeof(random)) != 1)
+            return false;
+        ToHex(random, sizeof(random), token);
+
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        SHA256(reinterpret_cast<const unsigned char*>(token), HEX_LENGTH, digest);
+        ToHex(digest, sizeof(digest), hash);
+        return true;
     }
 };
 
+// The token issued to a user, reused on every denied join until it expires.
+struct IssuedToken final
+{
+    time_t expires;
+    std::string notice;
+};
+
+// Keeps the token pool topped up so that denied joins never generate tokens themselves.
+class TokenPoolTimer final : public Timer
+{
+private:
+    ModuleCaptchaCheck* parent;
+
+public:
+    TokenPoolTimer(ModuleCaptchaCheck* Parent)
+        : Timer(10, true), parent(Parent) {}
+
+    bool Tick() override;
+};
+
+// Per-user /VERIFY bookkeeping used for rate limiting and remembering failures.
+struct VerifyState final
+{
+    time_t window_start = 0;
+    unsigned long attempts = 0;
+
+    // The last token the database rejected for this user, and until when
+    // that answer is reused without asking the database again.
+    std::string failed_token;
+    time_t failed_until = 0;
+};
+
+// SQL Query for token validation. Shared by every user verifying the same token.
+class ValidateTokenQuery final : public SQL::Query
+{
+private:
+    ModuleCaptchaCheck* parent;
+    const std::string token;
+
+public:
+    ValidateTokenQuery(ModuleCaptchaCheck* Parent, const std::string& Token);
+
+    void OnResult(SQL::Result& result) override;
+    void OnError(const SQL::Error& error) override;
+};
+
 class ModuleCaptchaCheck final : public Module
 {
 private:
@@ -90,6 +138,24 @@ private:
     BoolExtItem captcha_verified;
     CommandVerificar cmdverificar;
     Account::API accountapi;
+    SimpleExtItem<VerifyState> verify_state;
+
+    // Tokens with a query in flight, mapped to the UUIDs of the users waiting on them.
+    std::unordered_map<std::string, std::vector<std::string>> pending_verifies;
+    unsigned long verify_limit;
+    unsigned long verify_period;
+    unsigned long fail_cache;
+
+    SimpleExtItem<IssuedToken> issued_token;
+    std::vector<CaptchaToken> token_pool;
+    size_t token_pool_size;
+    unsigned long token_expiry;
+    std::string message;
+    TokenPoolTimer pool_timer;
+
+    // Parsed from <captchaconfig> once per rehash rather than on every join.
+    std::unordered_set<std::string, irc::insensitive, irc::StrHashComp> whitelist_channels;
+    std::bitset<65536> whitelist_ports;
 
 public:
     ModuleCaptchaCheck()
@@ -97,7 +163,18 @@ public:
           sql(this, "SQL"),
           captcha_verified(this, "captcha-verified", ExtensionType::USER, true),
           cmdverificar(this, this),
-          accountapi(this) {}
+          accountapi(this),
+          verify_state(this, "captcha-verify-state", ExtensionType::USER),
+          issued_token(this, "captcha-token", ExtensionType::USER),
+          pool_timer(this)
+    {
+        ServerInstance->Timers.AddTimer(&pool_timer);
+    }
+
+    ~ModuleCaptchaCheck() override
+    {
+        ServerInstance->Timers.DelTimer(&pool_timer);
+    }
 
     void ReadConfig(ConfigStatus& status) override
     {
@@ -105,7 +182,18 @@ public:
 
         // Read reCAPTCHA URL and SQL query
         captcha_url = tag->getString("url");
-        query = tag->getString("query", "SELECT COUNT(*) FROM recaptcha_app_verificationtoken WHERE token = $1 AND created_at + INTERVAL '30 minutes' > NOW()", 1);
+        query = tag->getString("query", "SELECT COUNT(*) FROM recaptcha_app_verificationtoken WHERE token = ? AND created_at + INTERVAL '30 minutes' > NOW()", 1);
+
+        // Older configs used a PostgreSQL style placeholder.
+        for (size_t pos; (pos = query.find("$1")) != std::string::npos; )
+            query.replace(pos, 2, "?");
+
+        verify_limit = tag->getNum<unsigned long>("verifylimit", 5, 1);
+        verify_period = tag->getDuration("verifyperiod", 60, 1);
+        fail_cache = tag->getDuration("failcache", 30);
+        token_expiry = tag->getDuration("tokenexpiry", 30 * 60, 60);
+        token_pool_size = tag->getNum<size_t>("tokenpool", 64, 1, 4096);
+        message = tag->getString("message", "*** reCAPTCHA: Verify your connection at {url}.");
 
         // Setup SQL provider
         std::string dbid = tag->getString("dbid", "default");
@@ -115,40 +203,57 @@ public:
         {
             throw ModuleException(this, INSP_FORMAT("*** reCAPTCHA: Could not find SQL provider with id '{}'.", dbid));
         }
-    }
 
-    ModResult OnUserPreJoin(LocalUser* user, Channel* chan, const std::string& cname, std::string& privs, const std::string& keygiven, bool override) override
-    {
-        if (user->IsOper())
-            return MOD_RES_PASSTHRU;
+        decltype(whitelist_channels) newchannels;
+        irc::commasepstream chanstream(tag->getString("whitelistchans"));
+        for (std::string channel_name; chanstream.GetToken(channel_name); )
+            newchannels.insert(channel_name);
 
-        // Check if the user is identified to NickServ
-    if (accountapi && accountapi->GetAccountName(user))
-    {
-        user->WriteNotice("*** reCAPTCHA: NickServ account verified. You may join channels.");
-        return MOD_RES_PASSTHRU;
+        std::bitset<65536> newports;
+        irc::commasepstream portstream(tag->getString("whitelistports"));
+        for (std::string port_str; portstream.GetToken(port_str); )
+        {
+            unsigned long port = ConvToNum<unsigned long>(port_str);
+            if (!port || port > 65535)
+                throw ModuleException(this, INSP_FORMAT("*** reCAPTCHA: Invalid port '{}' in <captchaconfig:whitelistports> at {}.", port_str, tag->source.str()));
+            newports.set(port);
+        }
+
+        whitelist_channels.swap(newchannels);
+        whitelist_ports = newports;
+
+        token_pool.reserve(token_pool_size);
+        RefillTokenPool();
     }
 
-        auto& tag = ServerInstance->Config->ConfValue("captchaconfig");
-        std::set<std::string> whitelist_channels;
-        std::stringstream chanstream(tag->getString("whitelistchans"));
-        std::string channel_name;
-        while (std::getline(chanstream, channel_name, ','))
-            whitelist_channels.insert(channel_name);
+    void RefillTokenPool()
+    {
+        while (token_pool.size() < token_pool_size)
+        {
+            CaptchaToken entry;
+            if (!entry.Generate())
+            {
+                ServerInstance->Logs.Normal(MODNAME, "Unable to generate verification tokens: RAND_bytes failed");
+                break;
+            }
+            token_pool.push_back(entry);
+        }
+    }
 
-        if (whitelist_channels.find(cname) != whitelist_channels.end())
+    ModResult OnUserPreJoin(LocalUser* user, Channel* chan, const std::string& cname, std::string& privs, const std::string& keygiven, bool override) override
+    {
+        // Cheapest checks first; most joins come from users who already verified.
+        if (captcha_verified.Get(user) || user->IsOper())
             return MOD_RES_PASSTHRU;
 
-        std::set<int> whitelist_ports;
-        std::stringstream portstream(tag->getString("whitelistports"));
-        std::string port_str;
-        while (std::getline(portstream, port_str, ','))
-            whitelist_ports.insert(std::stoi(port_str));
+        // Users identified to NickServ don't need to verify.
+        if (accountapi && accountapi->GetAccountName(user))
+            return MOD_RES_PASSTHRU;
 
-        if (whitelist_ports.find(user->server_sa.port()) != whitelist_ports.end())
+        if (whitelist_ports.test(user->server_sa.port()))
             return MOD_RES_PASSTHRU;
 
-        if (captcha_verified.Get(user))
+        if (whitelist_channels.count(cname))
             return MOD_RES_PASSTHRU;
 
         NotifyUserToVerify(user);
@@ -157,71 +262,161 @@ public:
 
     void ValidateToken(User* user, const std::string& token)
     {
+        if (captcha_verified.Get(user))
+        {
+            user->WriteNotice("*** reCAPTCHA: You are already verified.");
+            return;
+        }
+
         if (!sql)
         {
             user->WriteNotice("*** reCAPTCHA: SQL database is not available.");
             return;
         }
 
-        // Replace $1 placeholder with the actual token value
-        std::string formatted_query = INSP_FORMAT(
-            "SELECT COUNT(*) FROM recaptcha_app_verificationtoken WHERE token = '{}' AND created_at + INTERVAL '30 minutes' > NOW()",
-            token);
-
-        sql->Submit(new ValidateTokenQuery(this, user, captcha_verified), formatted_query);
-    }
-
-private:
-    void NotifyUserToVerify(User* user)
-    {
-        auto& tag = ServerInstance->Config->ConfValue("captchaconfig");
+        VerifyState* state = verify_state.Get(user);
+        if (!state)
+        {
+            state = new VerifyState();
+            verify_state.Set(user, state);
+        }
 
-        // Generate token
-        std::string token = GenerateToken();
-        std::string hash = GenerateHash(token);
+        const time_t now = ServerInstance->Time();
+        if (now - state->window_start >= static_cast<time_t>(verify_period))
+        {
+            state->window_start = now;
+            state->attempts = 0;
+        }
 
-        // Debug logs
-        ServerInstance->Logs.Debug(MODNAME, "Generated token: {}", token);
-        ServerInstance->Logs.Debug(MODNAME, "Generated hash: {}", hash);
+        if (++state->attempts > verify_limit)
+        {
+            user->WriteNotice(INSP_FORMAT("*** reCAPTCHA: Too many verification attempts. Please wait {} before trying again.",
+                Duration::ToString(state->window_start + verify_period - now)));
+            return;
+        }
 
-        // Build verification message
-        std::string message = tag->getString("message", "*** reCAPTCHA: Verify your connection at {url}.");
-        std::string link = captcha_url + "?code=" + token + "&hn=" + hash;
+        if (state->failed_until > now && state->failed_token == token)
+        {
+            user->WriteNotice("*** reCAPTCHA: Verification failed. Token not found or expired.");
+            return;
+        }
 
-        size_t pos = message.find("{url}");
-        if (pos != std::string::npos)
-            message.replace(pos, 5, link);
+        // If this token is already being checked just wait for that answer.
+        auto it = pending_verifies.find(token);
+        if (it != pending_verifies.end())
+        {
+            if (std::find(it->second.begin(), it->second.end(), user->uuid) == it->second.end())
+                it->second.push_back(user->uuid);
+            return;
+        }
 
-        user->WriteNotice(message);
+        pending_verifies[token].push_back(user->uuid);
+        sql->Submit(new ValidateTokenQuery(this, token), query, SQL::ParamList{ token });
     }
 
-    std::string GenerateToken()
+    void OnTokenResult(const std::string& token, bool verified, const std::string& message, bool remember = true)
     {
-        static const char hex_chars[] = "0123456789abcdef";
-        std::string token;
+        auto it = pending_verifies.find(token);
+        if (it == pending_verifies.end())
+            return;
+
+        const std::vector<std::string> waiting = std::move(it->second);
+        pending_verifies.erase(it);
 
-        for (int i = 0; i < 64; ++i)
-            token += hex_chars[std::rand() % 16];
+        for (const auto& uuid : waiting)
+        {
+            // The user may have quit while the query was running.
+            User* user = ServerInstance->Users.FindUUID(uuid);
+            if (!user)
+                continue;
 
-        return token;
+            if (verified)
+            {
+                captcha_verified.Set(user, true);
+                verify_state.Unset(user);
+                issued_token.Unset(user);
+            }
+            else if (remember && fail_cache)
+            {
+                VerifyState* state = verify_state.Get(user);
+                if (state)
+                {
+                    state->failed_token = token;
+                    state->failed_until = ServerInstance->Time() + fail_cache;
+                }
+            }
+            user->WriteNotice(message);
+        }
     }
 
-    std::string GenerateHash(const std::string& token)
+private:
+    void NotifyUserToVerify(User* user)
     {
-        unsigned char hash[SHA256_DIGEST_LENGTH];
-        SHA256(reinterpret_cast<const unsigned char*>(token.c_str()), token.size(), hash);
-
-        std::string hash_string;
-        for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i)
+        const time_t now = ServerInstance->Time();
+        IssuedToken* issued = issued_token.Get(user);
+        if (!issued || issued->expires <= now)
         {
-            hash_string += "0123456789abcdef"[hash[i] >> 4];
-            hash_string += "0123456789abcdef"[hash[i] & 0xf];
+            if (token_pool.empty())
+                RefillTokenPool();
+
+            if (token_pool.empty())
+            {
+                user->WriteNotice("*** reCAPTCHA: Unable to generate a verification link right now, please try again later.");
+                return;
+            }
+
+            const CaptchaToken& entry = token_pool.back();
+            std::string link = captcha_url + "?code=" + entry.token + "&hn=" + entry.hash;
+            token_pool.pop_back();
+
+            std::string notice = message;
+            size_t pos = notice.find("{url}");
+            if (pos != std::string::npos)
+                notice.replace(pos, 5, link);
+
+            issued = new IssuedToken{ now + static_cast<time_t>(token_expiry), std::move(notice) };
+            issued_token.Set(user, issued);
         }
 
-        return hash_string;
+        user->WriteNotice(issued->notice);
     }
 };
 
+ValidateTokenQuery::ValidateTokenQuery(ModuleCaptchaCheck* Parent, const std::string& Token)
+    : SQL::Query(Parent), parent(Parent), token(Token)
+{
+}
+
+void ValidateTokenQuery::OnResult(SQL::Result& result)
+{
+    SQL::Row row;
+    if (!result.GetRow(row))
+    {
+        parent->OnTokenResult(token, false, "*** reCAPTCHA: Verification failed. Token not found.");
+        return;
+    }
+
+    const std::string count = row[0].value_or("0");
+    if (count == "1")
+        parent->OnTokenResult(token, true, "*** reCAPTCHA: Verification successful. You may now join channels.");
+    else
+        parent->OnTokenResult(token, false, "*** reCAPTCHA: Verification failed. Token not found or expired.");
+}
+
+void ValidateTokenQuery::OnError(const SQL::Error& error)
+{
+    ServerInstance->Logs.Normal(MODNAME, "SQL error while verifying a token: {}", error.ToString());
+
+    // Don't remember this as a failure; the user can simply try again.
+    parent->OnTokenResult(token, false, INSP_FORMAT("*** reCAPTCHA: SQL Error: {}", error.ToString()), false);
+}
+
+bool TokenPoolTimer::Tick()
+{
+    parent->RefillTokenPool();
+    return true;
+}
+
 CmdResult CommandVerificar::Handle(User* user, const Params& parameters)
 {
     const std::string& token = parameters[0];
@@ -22,15 +22,20 @@
 
 #include "inspircd.h"
 #include "modules/whois.h"
+#include "whoisextras.h"
 
 class ModuleWhoisPort final
 	: public Module
 	, public Whois::EventListener
 {
+private:
+	WhoisExtras::Cache whois_cache;
+
 public:
 	ModuleWhoisPort()
 		: Module(VF_OPTCOMMON, "Adds the port number of the user to the WHOIS response for operators only.")
 		, Whois::EventListener(this)
+		, whois_cache(this, WhoisExtras::PORT)
 	{
 	}
 
@@ -40,21 +45,21 @@ public:
 		User* target = whois.GetTarget();
 
 		// Only show port information if the requesting user (source) is an IRC operator with privs.
-		if (!user->HasPrivPermission("users/auspex"))
-            {
-                user->WriteNotice("You do not have permission to use this command.");
-                return CmdResult::FAILURE;
-            }
+		if (!source->HasPrivPermission("users/auspex"))
+			return;
+
 		// Check if the target user is local or remote.
 		LocalUser* luser = IS_LOCAL(target);
 		if (!luser)
 			return;
 
-		// Get the port the user is connected on.
-		int port = luser->server_sa.port();
+		// The port the user is connected on never changes, so the line only needs building once.
+		const std::string& line = whois_cache.Get(target, std::string(), [luser](const std::string&) {
+			return "is using port " + ConvToStr(luser->server_sa.port());
+		});
 
 		// Send the port information in the WHOIS response, but only for operators.
-		whois.SendLine(RPL_WHOISSPECIAL, "*", "is using port " + ConvToStr(port));
+		whois.SendLine(RPL_WHOISSPECIAL, "*", line);
 	}
 };
 
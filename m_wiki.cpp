@@ -22,15 +22,154 @@
 
 #include "inspircd.h"
 #include "modules/sql.h"
+#include "modules/ircv3_batch.h"
+#include "clientprotocolmsg.h"
+#include "hooklatency.h"
 #include <algorithm>
+#include <cctype>
+#include <memory>
 #include <numeric>
+#include <set>
 #include <vector>
 
 // Cache to map keywords to slugs.
 using WikiMap = std::map<std::string, std::vector<std::string>>;
 
+// A single (keyword, slug) row of wiki_entries.
+using WikiEntry = std::pair<std::string, std::string>;
+using WikiEntrySet = std::set<WikiEntry>;
+
+// An ADD or DEL queued by an oper during WIKI IMPORT. A DEL with an empty
+// slug removes every slug of the keyword.
+struct WikiChange {
+    bool add;
+    std::string keyword;
+    std::string slug;
+};
+using WikiImport = std::vector<WikiChange>;
+
+// The queries written for one change, e.g. a WIKI IMPORT. The cache has
+// already been updated by the time they run so if any of them fails the
+// cache is reloaded from the database once they have all completed.
+struct WikiWriteBatch {
+    //  The oper to report to once every write has landed, if any.
+    std::string uuid;
+    std::string summary;
+
+    //  Starts at one so the batch can not complete while it is submitted.
+    size_t pending = 1;
+    size_t failed = 0;
+};
+
+// Aho-Corasick automaton over the wiki keywords so a message can be checked
+// against every keyword in a single pass without copying it.
+class KeywordMatcher final {
+ private:
+    struct Node {
+        std::vector<std::pair<unsigned char, uint32_t>> next; // Sorted by byte.
+        uint32_t fail = 0;
+        uint32_t output = 0; // Nearest node on the fail chain with keywords (0 if none).
+        std::vector<uint32_t> keywords;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<uint32_t> seen; // The scan which last reported each keyword.
+    uint32_t scan = 0;
+    bool foldCase = true;
+
+    unsigned char Map(char ch) const {
+        const auto c = static_cast<unsigned char>(ch);
+        return (foldCase && c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+
+    static uint32_t Find(const Node& node, unsigned char c) {
+        auto it = std::lower_bound(node.next.begin(), node.next.end(), c,
+            [](const std::pair<unsigned char, uint32_t>& edge, unsigned char value) { return edge.first < value; });
+        return (it != node.next.end() && it->first == c) ? it->second : 0;
+    }
+
+ public:
+    // Builds the automaton. Keyword ids are their index in the vector.
+    void Build(const std::vector<const std::string*>& keywords, bool caseSensitive) {
+        foldCase = !caseSensitive;
+        nodes.assign(1, Node());
+        for (uint32_t id = 0; id < keywords.size(); ++id) {
+            uint32_t cur = 0;
+            for (char ch : *keywords[id]) {
+                const unsigned char c = Map(ch);
+                uint32_t nxt = Find(nodes[cur], c);
+                if (!nxt) {
+                    nxt = static_cast<uint32_t>(nodes.size());
+                    auto& edges = nodes[cur].next;
+                    auto pos = std::lower_bound(edges.begin(), edges.end(), std::make_pair(c, uint32_t(0)));
+                    edges.insert(pos, std::make_pair(c, nxt));
+                    nodes.emplace_back();
+                }
+                cur = nxt;
+            }
+            if (cur)
+                nodes[cur].keywords.push_back(id);
+        }
+
+        // Breadth-first so every fail target is finished before it is used.
+        std::vector<uint32_t> queue;
+        queue.reserve(nodes.size());
+        for (const auto& [_, child] : nodes[0].next) {
+            nodes[child].output = nodes[child].keywords.empty() ? 0 : child;
+            queue.push_back(child);
+        }
+
+        for (size_t i = 0; i < queue.size(); ++i) {
+            const uint32_t cur = queue[i];
+            for (const auto& [c, child] : nodes[cur].next) {
+                uint32_t fail = nodes[cur].fail;
+                uint32_t target;
+                while (!(target = Find(nodes[fail], c)) && fail)
+                    fail = nodes[fail].fail;
+
+                nodes[child].fail = target;
+                nodes[child].output = nodes[child].keywords.empty() ? nodes[target].output : child;
+                queue.push_back(child);
+            }
+        }
+
+        seen.assign(keywords.size(), 0);
+        scan = 0;
+    }
+
+    // Finds the ids of every keyword in the text. Each id is reported once.
+    void Match(const std::string& text, std::vector<uint32_t>& matches) {
+        matches.clear();
+        if (nodes.size() <= 1)
+            return;
+
+        if (++scan == 0) {
+            std::fill(seen.begin(), seen.end(), 0);
+            scan = 1;
+        }
+
+        uint32_t cur = 0;
+        for (char ch : text) {
+            const unsigned char c = Map(ch);
+            uint32_t nxt;
+            while (!(nxt = Find(nodes[cur], c)) && cur)
+                cur = nodes[cur].fail;
+            cur = nxt;
+
+            for (uint32_t out = nodes[cur].output; out; out = nodes[nodes[out].fail].output) {
+                for (uint32_t id : nodes[out].keywords) {
+                    if (seen[id] != scan) {
+                        seen[id] = scan;
+                        matches.push_back(id);
+                    }
+                }
+            }
+        }
+    }
+};
+
 // Enum to represent query operations.
-enum class WikiOp { SHOWALL, SHOWONE, INSERT, DELETE };
+enum class WikiOp { INSERT, DELETE };
 
 // Forward declaration of ModuleWiki.
 class ModuleWiki;
@@ -47,15 +186,51 @@ class LoadAllQuery final : public SQL::Query {
     void OnError(const SQL::Error& error) override;
 };
 
-// Query to handle operations like SHOW, INSERT, DELETE.
+// Query to apply the rows of wiki_changes written since the last sync. Used
+// when <wiki:syncinterval> is set; the table is expected to look like:
+//   CREATE TABLE wiki_changes (id BIGINT AUTO_INCREMENT PRIMARY KEY,
+//       op CHAR(1) NOT NULL, keyword VARCHAR(255) NOT NULL, slug VARCHAR(255) NOT NULL);
+class SyncQuery final : public SQL::Query {
+ private:
+    ModuleWiki* mod;
+
+ public:
+    explicit SyncQuery(ModuleWiki* m);
+
+    void OnResult(SQL::Result& result) override;
+    void OnError(const SQL::Error& error) override;
+};
+
+// Timer which periodically pulls changes made by other servers.
+class SyncTimer final : public Timer {
+ private:
+    ModuleWiki* mod;
+
+ public:
+    SyncTimer(ModuleWiki* m, unsigned long interval)
+        : Timer(interval, true),
+          mod(m) {}
+
+    bool Tick() override;
+};
+
+// Query to handle operations like INSERT, DELETE. A multi-row INSERT which
+// fails is retried one row at a time so one bad or duplicate row does not
+// take the rest of its chunk with it.
 class WikiQuery final : public SQL::Query {
  private:
     ModuleWiki* mod;
     WikiOp operation;
-    std::string customData;
+    std::shared_ptr<WikiWriteBatch> batch;
 
  public:
-    WikiQuery(ModuleWiki* m, WikiOp op, const std::string& cd = "");
+    //  The single row statement and parameters used to retry, if any.
+    const std::string retry;
+    const SQL::ParamList params;
+    const size_t rows;
+
+    WikiQuery(ModuleWiki* m, WikiOp op, const std::shared_ptr<WikiWriteBatch>& b,
+        const std::string& r = "", const SQL::ParamList& p = {}, size_t n = 1);
 
     void OnResult(SQL::Result& result) override;
     void OnError(const SQL::Error& error) override;
@@ -65,43 +240,106 @@ class WikiQuery final : public SQL::Query {
 class ModuleWiki final : public Module {
  private:
     dynamic_reference<SQL::Provider> sql;
+    IRCv3::Batch::API batchmanager;
+    SimpleExtItem<WikiImport> importExt;
     WikiMap wikiCache;
 
+    //  Keyword automaton, rebuilt lazily after wikiCache changes.
+    KeywordMatcher matcher;
+    std::vector<const std::string*> matcherKeywords;
+    std::vector<uint32_t> matchedKeywords;
+    bool matcherDirty = true;
+
     std::string dbid;
     bool autoRespond;
     bool caseSensitive;
+    bool matchAll;
     std::string wikiPrefix;
     std::string helpChannel;
+    size_t showPageSize;
+
+    //  Incremental sync state. syncRevision is the last wiki_changes id
+    //  that has been applied to wikiCache.
+    unsigned long syncInterval = 0;
+    uint64_t syncRevision = 0;
+    bool loaded = false;
+    bool queryPending = false;
+    std::unique_ptr<SyncTimer> syncTimer;
 
  public:
     ModuleWiki()
         : Module(VF_VENDOR, "Store wiki slug of wikipages of the network."),
           sql(this, "SQL"),
+          batchmanager(this),
+          importExt(this, "wiki-import", ExtensionType::USER),
           cmd(this),
-          cmdSend(this) {} //  Correctly initialize /SEND command
+          cmdSend(this), //  Correctly initialize /SEND command
+          latency(this, "wiki"),
+          message_latency(latency.Add("OnUserMessage")) {}
+
+    ~ModuleWiki() override {
+        if (syncTimer)
+            ServerInstance->Timers.DelTimer(syncTimer.get());
+    }
 
     void ReadConfig(ConfigStatus& status) override;
     void OnUserMessage(User* user, const MessageTarget& target, const MessageDetails& details) override;
     void LoadAllEntries();
+    void SyncEntries();
+    void WriteEntries(const WikiEntrySet& added, const WikiEntrySet& removed, const std::shared_ptr<WikiWriteBatch>& batch = std::make_shared<WikiWriteBatch>());
+    void RetryRows(const WikiQuery& query, const std::shared_ptr<WikiWriteBatch>& batch);
+    void WriteDone(const std::shared_ptr<WikiWriteBatch>& batch, bool failed);
     void DoInsert(const std::string& rawKey, const std::string& slug);
     void DoDelete(const std::string& rawKey, const std::string& slug);
     void DoDeleteAll(const std::string& rawKey);
-    void OnShow(User* user, const std::string& rawKey);
-    void WriteSplitNotice(User* user, const std::string& message, size_t chunkSize = 400);
-    std::string EscapeString(const std::string& input);
+    void CommitImport(User* user, const WikiImport& changes);
+    void OnShow(User* user, const std::string& pattern, size_t page);
+    void SendLines(User* user, const std::vector<std::string>& lines);
 
     //  Public accessor methods for wikiCache and wikiPrefix
-    void ClearWikiCache() {
-        wikiCache.clear();
+    void ReplaceWikiCache(WikiMap& entries, uint64_t revision) {
+        wikiCache.swap(entries);
+        syncRevision = revision;
+        loaded = true;
+        queryPending = false;
+        RebuildMatcher();
+    }
+
+    void ApplyChanges(uint64_t revision) {
+        if (revision)
+            syncRevision = revision;
+        queryPending = false;
+        if (matcherDirty)
+            RebuildMatcher();
+    }
+
+    void QueryFailed() {
+        queryPending = false;
     }
 
     void AddWikiEntry(const std::string& keyword, const std::string& slug) {
         auto& slugs = wikiCache[keyword];
         if (std::find(slugs.begin(), slugs.end(), slug) == slugs.end()) {
             slugs.push_back(slug);
+            matcherDirty = true;
         }
     }
 
+    void RemoveWikiKeyword(const std::string& keyword) {
+        if (wikiCache.erase(keyword))
+            matcherDirty = true;
+    }
+
+    void RebuildMatcher() {
+        matcherKeywords.clear();
+        matcherKeywords.reserve(wikiCache.size());
+        for (const auto& [keyword, _] : wikiCache)
+            matcherKeywords.push_back(&keyword);
+
+        matcher.Build(matcherKeywords, caseSensitive);
+        matcherDirty = false;
+    }
+
     bool RemoveWikiEntry(const std::string& keyword, const std::string& slug) {
         auto it = wikiCache.find(keyword);
         if (it != wikiCache.end()) {
@@ -111,6 +349,7 @@ class ModuleWiki final : public Module {
                 slugs.erase(slug_it);
                 if (slugs.empty()) {
                     wikiCache.erase(it);
+                    matcherDirty = true;
                 }
                 return true;
             }
@@ -118,6 +357,11 @@ class ModuleWiki final : public Module {
         return false;
     }
 
+    bool HasWikiEntry(const std::string& keyword, const std::string& slug) const {
+        auto it = wikiCache.find(keyword);
+        return it != wikiCache.end() && std::find(it->second.begin(), it->second.end(), slug) != it->second.end();
+    }
+
     void GetWikiSlugs(const std::string& keyword, std::vector<std::string>& slugs) const {
         auto it = wikiCache.find(keyword);
         if (it != wikiCache.end()) {
@@ -137,7 +381,9 @@ class ModuleWiki final : public Module {
         explicit CommandWiki(ModuleWiki* m)
             : Command(m, "WIKI", 1, 3),
               mod(m) {
-            syntax.push_back("{ADD|DEL|SHOW} [<keyword>] [<slug>]");
+            syntax.push_back("{ADD|DEL} <keyword> [<slug>]");
+            syntax.push_back("IMPORT {BEGIN|END|ABORT}");
+            syntax.push_back("SHOW [<keyword>|<pattern>] [<page>]");
         }
 
         CmdResult Handle(User* user, const Params& parameters) override;
@@ -162,123 +408,182 @@ class ModuleWiki final : public Module {
     
     CommandWiki cmd;
     CommandSend cmdSend;
+    Latency::Monitor latency;
+    Latency::Histogram& message_latency;
 };
 
-// Function to send split notices to users. This will change on next release.
-void ModuleWiki::WriteSplitNotice(User* user, const std::string& message, size_t chunkSize) {
-    size_t offset = 0;
-    while (offset < message.size()) {
-        size_t len = std::min(chunkSize, message.size() - offset);
-        user->WriteNotice(message.substr(offset, len));
-        offset += len;
+// Sends a multi-line reply to a user one notice per line. Local clients which
+// support IRCv3 batches get the lines wrapped in a batch.
+void ModuleWiki::SendLines(User* user, const std::vector<std::string>& lines) {
+    if (lines.empty())
+        return;
+
+    LocalUser* luser = IS_LOCAL(user);
+    if (!luser) {
+        //  Remote users are sent plain notices through their server.
+        for (const auto& line : lines)
+            user->WriteNotice(line);
+        return;
     }
-}
 
-// Escape special characters for SQL queries.
-std::string ModuleWiki::EscapeString(const std::string& input) {
-    std::string escaped;
-    for (char c : input) {
-        if (c == '\'') //  Escape single quotes
-            escaped += "''";
-        else
-            escaped += c;
+    IRCv3::Batch::Batch batch("reverse.im/wiki");
+    if (batchmanager)
+        batchmanager->Start(batch);
+
+    for (const auto& line : lines) {
+        ClientProtocol::Messages::Privmsg notice(ClientProtocol::Messages::Privmsg::nocopy, ServerInstance->FakeClient, luser, line, MessageType::NOTICE);
+        batch.AddToBatch(notice);
+        luser->Send(ServerInstance->GetRFCEvents().privmsg, notice);
     }
-    return escaped;
+
+    if (batchmanager)
+        batchmanager->End(batch);
 }
 
 LoadAllQuery::LoadAllQuery(ModuleWiki* m)
     : SQL::Query(m), mod(m) {}
 
 void LoadAllQuery::OnResult(SQL::Result& result) {
-    mod->ClearWikiCache();
+    //  Build the new cache on the side so the old one keeps serving until
+    //  the whole table has been read.
+    WikiMap entries;
+    uint64_t revision = 0;
     SQL::Row row;
     while (result.GetRow(row)) {
         std::string keyword = row[0].value_or("");
         std::string slug = row[1].value_or("");
-        if (!keyword.empty() && !slug.empty())
-            mod->AddWikiEntry(keyword, slug);
+        if (row.size() > 2)
+            revision = ConvToNum<uint64_t>(row[2].value_or("0"));
+
+        if (keyword.empty() || slug.empty())
+            continue;
+
+        auto& slugs = entries[keyword];
+        if (std::find(slugs.begin(), slugs.end(), slug) == slugs.end())
+            slugs.push_back(slug);
     }
+    mod->ReplaceWikiCache(entries, revision);
     ServerInstance->SNO.WriteGlobalSno('a', "*** [wiki] Wiki database loaded successfully.");
 }
 
 void LoadAllQuery::OnError(const SQL::Error& error) {
+    mod->QueryFailed();
     ServerInstance->SNO.WriteGlobalSno('a', "*** [wiki] Error loading wiki database: " + std::string(error.ToString()));
 }
 
-//  WikiQuery implementation. 
-WikiQuery::WikiQuery(ModuleWiki* m, WikiOp op, const std::string& cd)
-    : SQL::Query(m), mod(m), operation(op), customData(cd) {}
+SyncQuery::SyncQuery(ModuleWiki* m)
+    : SQL::Query(m), mod(m) {}
 
-void WikiQuery::OnResult(SQL::Result& result) {
-    if (operation == WikiOp::SHOWONE) {
-        size_t pos = customData.find(' ');
-        if (pos == std::string::npos)
-            return;
+void SyncQuery::OnResult(SQL::Result& result) {
+    //  Rows are (id, op, keyword, slug) in id order. An 'A' row adds a slug,
+    //  a 'D' row removes one, or the whole keyword when the slug is empty.
+    //  Both are idempotent so replaying a change we made ourselves is harmless.
+    uint64_t revision = 0;
+    size_t applied = 0;
+    SQL::Row row;
+    while (result.GetRow(row)) {
+        revision = ConvToNum<uint64_t>(row[0].value_or("0"));
+        const std::string op = row[1].value_or("");
+        const std::string keyword = row[2].value_or("");
+        const std::string slug = row[3].value_or("");
+        if (keyword.empty())
+            continue;
+
+        if (op == "A" && !slug.empty())
+            mod->AddWikiEntry(keyword, slug);
+        else if (op == "D" && slug.empty())
+            mod->RemoveWikiKeyword(keyword);
+        else if (op == "D")
+            mod->RemoveWikiEntry(keyword, slug);
+        else
+            continue;
+        applied++;
+    }
 
-        std::string uuid = customData.substr(0, pos);
-        std::string rawKey = customData.substr(pos + 1);
+    mod->ApplyChanges(revision);
+    if (applied)
+        ServerInstance->Logs.Debug(MODNAME, "Applied {} wiki change(s) up to revision {}", applied, revision);
+}
 
-        User* user = ServerInstance->Users.FindUUID(uuid);
-        if (user) {
-            std::vector<std::string> slugs;
-            SQL::Row row;
-            while (result.GetRow(row)) {
-                std::string slug = row[1].value_or("");
-                if (!slug.empty())
-                    slugs.push_back(slug);
-            }
+void SyncQuery::OnError(const SQL::Error& error) {
+    mod->QueryFailed();
+    ServerInstance->SNO.WriteGlobalSno('a', "*** [wiki] Error syncing wiki database: " + std::string(error.ToString()));
+}
 
-            if (!slugs.empty()) {
-                std::string response = "*** [wiki] Wiki Page for '" + rawKey + "':\n";
-                for (const auto& slug : slugs) {
-                    response += mod->GetWikiPrefix() + slug + "\n";
-                }
-                mod->WriteSplitNotice(user, response);
-            } else {
-                user->WriteNotice("*** [wiki] Wiki Page found for '" + rawKey + "'.");
-            }
-        }
-    } else if (operation == WikiOp::SHOWALL) {
-        User* user = ServerInstance->Users.FindUUID(customData);
-        if (user) {
-            std::string message = "*** [wiki] All Wiki's in database:\n";
-            SQL::Row row;
-            while (result.GetRow(row)) {
-                std::string keyword = row[0].value_or("");
-                std::string slug = row[1].value_or("");
-                if (!keyword.empty() && !slug.empty()) {
-                    message += keyword + " -> " + mod->GetWikiPrefix() + slug + "\n";
-                }
-            }
-            mod->WriteSplitNotice(user, message);
-        }
-    }
+bool SyncTimer::Tick() {
+    mod->SyncEntries();
+    return true;
+}
+
+//  WikiQuery implementation. 
+WikiQuery::WikiQuery(ModuleWiki* m, WikiOp op, const std::shared_ptr<WikiWriteBatch>& b,
+    const std::string& r, const SQL::ParamList& p, size_t n)
+    : SQL::Query(m), mod(m), operation(op), batch(b), retry(r), params(p), rows(n) {}
+
+void WikiQuery::OnResult(SQL::Result& result) {
+    //  INSERT and DELETE have already been applied to the cache.
+    mod->WriteDone(batch, false);
 }
 
 void WikiQuery::OnError(const SQL::Error& error) {
+    if (rows > 1 && !retry.empty()) {
+        mod->RetryRows(*this, batch);
+        return;
+    }
+
     ServerInstance->SNO.WriteGlobalSno('a', "*** [wiki] Query error: " + std::string(error.ToString()));
+    mod->WriteDone(batch, true);
 }
 
 //  ModuleWiki implementation. 
 void ModuleWiki::ReadConfig(ConfigStatus& status) {
-    wikiCache.clear();
-
+    latency.ReadConfig();
     auto& tag = ServerInstance->Config->ConfValue("wiki");
-    dbid = tag->getString("dbid", "wikidb");
+    const std::string newdbid = tag->getString("dbid", "wikidb");
+    if (newdbid != dbid) {
+        //  A different database invalidates what we have synced so far.
+        dbid = newdbid;
+        loaded = false;
+        queryPending = false;
+        syncRevision = 0;
+    }
     sql.SetProvider("SQL/" + dbid);
     autoRespond = tag->getBool("autorespond", true);
     caseSensitive = tag->getBool("casesensitive", false);
     wikiPrefix = tag->getString("wikiprefix", "https:// wiki.t-chat.fr/w/");
     helpChannel = tag->getString("helpchannel", "#aide");
+    matchAll = tag->getBool("matchall", false);
+    showPageSize = tag->getNum<size_t>("showpagesize", 20, 1, 500);
+    syncInterval = tag->getDuration("syncinterval", 0);
+    matcherDirty = true;
 
     if (!sql) {
         throw ModuleException(this, "*** [wiki] Could not find SQL provider: " + dbid);
     }
 
-    LoadAllEntries();
+    if (syncInterval) {
+        if (!syncTimer) {
+            syncTimer = std::make_unique<SyncTimer>(this, syncInterval);
+            ServerInstance->Timers.AddTimer(syncTimer.get());
+        } else {
+            //  SetInterval re-adds the timer itself.
+            syncTimer->SetInterval(syncInterval);
+        }
+    } else if (syncTimer) {
+        ServerInstance->Timers.DelTimer(syncTimer.get());
+        syncTimer.reset();
+    }
+
+    //  With incremental sync enabled a rehash only needs to pick up changes,
+    //  which SyncEntries does by itself once the first load has completed.
+    if (syncInterval && loaded)
+        SyncEntries();
+    else
+        LoadAllEntries();
 }
 
 void ModuleWiki::OnUserMessage(User* user, const MessageTarget& target, const MessageDetails& details) {
+    Latency::ScopedTimer latencytimer(message_latency);
     if (!autoRespond || target.type != MessageTarget::TYPE_CHANNEL)
         return;
 
@@ -286,18 +591,34 @@ void ModuleWiki::OnUserMessage(User* user, const MessageTarget& target, const Me
     if (!chan || !irc::equals(chan->name, helpChannel))
         return;
 
-    std::string text = details.text;
-    if (!caseSensitive) {
-        std::transform(text.begin(), text.end(), text.begin(), ::tolower);
+    if (matcherDirty)
+        RebuildMatcher();
+
+    matcher.Match(details.text, matchedKeywords);
+    if (matchedKeywords.empty())
+        return;
+
+    if (matchAll) {
+        //  Longest (most specific) keywords first, ties in keyword order.
+        std::sort(matchedKeywords.begin(), matchedKeywords.end(), [this](uint32_t a, uint32_t b) {
+            const size_t alen = matcherKeywords[a]->length();
+            const size_t blen = matcherKeywords[b]->length();
+            return alen != blen ? alen > blen : a < b;
+        });
+    } else {
+        //  Only respond with the first keyword in keyword order.
+        auto first = std::min_element(matchedKeywords.begin(), matchedKeywords.end());
+        matchedKeywords.assign(1, *first);
     }
 
-    for (const auto& [keyword, slugs] : wikiCache) {
-        if (text.find(keyword) != std::string::npos) {
-            for (const auto& slug : slugs) {
-                std::string link = GetWikiPrefix() + slug;
-                chan->WriteRemoteNotice("[wiki] " + user->nick + ": " + link);
-            }
-            break; //  Remove this break if you want to respond to multiple keywords in one message
+    for (uint32_t id : matchedKeywords) {
+        auto it = wikiCache.find(*matcherKeywords[id]);
+        if (it == wikiCache.end())
+            continue;
+
+        for (const auto& slug : it->second) {
+            std::string link = GetWikiPrefix() + slug;
+            chan->WriteRemoteNotice("[wiki] " + user->nick + ": " + link);
         }
     }
 }
@@ -308,34 +629,153 @@ void ModuleWiki::LoadAllEntries() {
         return;
     }
 
-    sql->Submit(new LoadAllQuery(this), "SELECT keyword, slug FROM wiki_entries");
+    if (!syncInterval) {
+        sql->Submit(new LoadAllQuery(this), "SELECT keyword, slug FROM wiki_entries");
+        return;
+    }
+
+    //  Read the current revision in the same statement so that the snapshot
+    //  and the point to resume syncing from agree with each other.
+    queryPending = true;
+    sql->Submit(new LoadAllQuery(this),
+        "SELECT keyword, slug, (SELECT COALESCE(MAX(id), 0) FROM wiki_changes) FROM wiki_entries");
 }
 
-void ModuleWiki::DoInsert(const std::string& rawKey, const std::string& slug) {
+void ModuleWiki::SyncEntries() {
+    if (!sql || queryPending)
+        return;
+
+    if (!loaded) {
+        LoadAllEntries();
+        return;
+    }
+
+    queryPending = true;
+    sql->Submit(new SyncQuery(this), INSP_FORMAT(
+        "SELECT id, op, keyword, slug FROM wiki_changes WHERE id > {} ORDER BY id ASC",
+        syncRevision));
+}
+
+// Submits one statement per chunk of rows so that a bulk import is a handful
+// of round trips rather than one per row. The chunk size keeps the number of
+// placeholders under the limit of the SQL backends. If retry is set a chunk
+// which fails is written again one row at a time.
+template<typename Iterator, typename Fill>
+static void SubmitRows(SQL::Provider& sql, ModuleWiki* mod, WikiOp op, const std::shared_ptr<WikiWriteBatch>& batch,
+    const std::string& head, const char* row, const char* separator, bool retry, Iterator first, Iterator last, Fill fill) {
+    static constexpr size_t ROWS_PER_QUERY = 200;
+
+    while (first != last) {
+        std::string query = head;
+        SQL::ParamList params;
+        size_t rows = 0;
+        for (; first != last && rows < ROWS_PER_QUERY; ++first, ++rows) {
+            if (rows)
+                query.append(separator);
+            query.append(row);
+            fill(*first, params);
+        }
+
+        batch->pending++;
+        if (retry)
+            sql.Submit(new WikiQuery(mod, op, batch, head + row, params, rows), query, params);
+        else
+            sql.Submit(new WikiQuery(mod, op, batch), query, params);
+    }
+}
+
+// Writes a set of net changes to wiki_entries and, when incremental sync is
+// enabled, records them in wiki_changes for the other servers.
+void ModuleWiki::WriteEntries(const WikiEntrySet& added, const WikiEntrySet& removed, const std::shared_ptr<WikiWriteBatch>& batch) {
     if (!sql) {
         ServerInstance->SNO.WriteGlobalSno('a', "*** [wiki] SQL database is not available.");
+        WriteDone(batch, true);
+        return;
+    }
+
+    const auto fillEntry = [](const WikiEntry& entry, SQL::ParamList& params) {
+        params.push_back(entry.first);
+        params.push_back(entry.second);
+    };
+
+    SubmitRows(*sql, this, WikiOp::DELETE, batch, "DELETE FROM wiki_entries WHERE ", "(keyword = ? AND slug = ?)", " OR ",
+        false, removed.begin(), removed.end(), fillEntry);
+
+    //  UNIQUE(keyword, slug) rejects a whole chunk if any of its rows already
+    //  exists, which can happen when the cache is behind the database, so
+    //  failed chunks are retried row by row.
+    SubmitRows(*sql, this, WikiOp::INSERT, batch, "INSERT INTO wiki_entries (keyword, slug) VALUES ", "(?, ?)", ", ",
+        true, added.begin(), added.end(), fillEntry);
+
+    if (!syncInterval) {
+        WriteDone(batch, false);
         return;
     }
 
-    //  Insert without duplicates due to UNIQUE(keyword, slug)
-    std::string query = INSP_FORMAT(
-        "INSERT INTO wiki_entries (keyword, slug) VALUES ('{}', '{}')",
-        EscapeString(rawKey), EscapeString(slug));
+    const auto logEntry = [](const char* op) {
+        return [op](const WikiEntry& entry, SQL::ParamList& params) {
+            params.push_back(op);
+            params.push_back(entry.first);
+            params.push_back(entry.second);
+        };
+    };
 
-    sql->Submit(new WikiQuery(this, WikiOp::INSERT), query);
+    SubmitRows(*sql, this, WikiOp::INSERT, batch, "INSERT INTO wiki_changes (op, keyword, slug) VALUES ", "(?, ?, ?)", ", ",
+        false, removed.begin(), removed.end(), logEntry("D"));
+    SubmitRows(*sql, this, WikiOp::INSERT, batch, "INSERT INTO wiki_changes (op, keyword, slug) VALUES ", "(?, ?, ?)", ", ",
+        false, added.begin(), added.end(), logEntry("A"));
+    WriteDone(batch, false);
 }
 
-void ModuleWiki::DoDelete(const std::string& rawKey, const std::string& slug) {
+// Writes the rows of a failed multi-row query one at a time.
+void ModuleWiki::RetryRows(const WikiQuery& query, const std::shared_ptr<WikiWriteBatch>& batch) {
     if (!sql) {
-        ServerInstance->SNO.WriteGlobalSno('a', "*** [wiki] SQL database is not available.");
+        WriteDone(batch, true);
         return;
     }
 
-    std::string query = INSP_FORMAT(
-        "DELETE FROM wiki_entries WHERE keyword = '{}' AND slug = '{}'",
-        EscapeString(rawKey), EscapeString(slug));
+    const size_t perRow = query.params.size() / query.rows;
+    for (size_t row = 0; row < query.rows; ++row) {
+        SQL::ParamList params(query.params.begin() + row * perRow, query.params.begin() + (row + 1) * perRow);
+        batch->pending++;
+        sql->Submit(new WikiQuery(this, WikiOp::INSERT, batch), query.retry, params);
+    }
 
-    sql->Submit(new WikiQuery(this, WikiOp::DELETE), query);
+    //  The failed chunk itself is accounted for by its rows.
+    WriteDone(batch, false);
+}
+
+// Called as each query of a batch completes.
+void ModuleWiki::WriteDone(const std::shared_ptr<WikiWriteBatch>& batch, bool failed) {
+    batch->failed += failed;
+    if (--batch->pending)
+        return;
+
+    User* user = batch->uuid.empty() ? nullptr : ServerInstance->Users.FindUUID(batch->uuid);
+    if (!batch->failed) {
+        if (user)
+            user->WriteNotice(batch->summary);
+        return;
+    }
+
+    if (user) {
+        user->WriteNotice("*** [wiki] " + ConvToStr(batch->failed) + " write(s) were rejected by the database; "
+            "reloading the wiki cache from the database.");
+    }
+
+    //  The cache already has changes which did not make it to the database
+    //  so the database is reloaded over it.
+    loaded = false;
+    if (!queryPending)
+        LoadAllEntries();
+}
+
+void ModuleWiki::DoInsert(const std::string& rawKey, const std::string& slug) {
+    WriteEntries({ { rawKey, slug } }, {});
+}
+
+void ModuleWiki::DoDelete(const std::string& rawKey, const std::string& slug) {
+    WriteEntries({}, { { rawKey, slug } });
 }
 
 void ModuleWiki::DoDeleteAll(const std::string& rawKey) {
@@ -344,25 +784,142 @@ void ModuleWiki::DoDeleteAll(const std::string& rawKey) {
         return;
     }
 
-    std::string query = INSP_FORMAT(
-        "DELETE FROM wiki_entries WHERE keyword = '{}'",
-        EscapeString(rawKey));
+    auto batch = std::make_shared<WikiWriteBatch>();
+    batch->pending++;
+    sql->Submit(new WikiQuery(this, WikiOp::DELETE, batch), "DELETE FROM wiki_entries WHERE keyword = ?", { rawKey });
+    if (syncInterval) {
+        batch->pending++;
+        sql->Submit(new WikiQuery(this, WikiOp::INSERT, batch),
+            "INSERT INTO wiki_changes (op, keyword, slug) VALUES ('D', ?, '')", { rawKey });
+    }
+    WriteDone(batch, false);
+}
+
+// Reduces a queued import to its net effect against the cache, applies it to
+// the cache and writes it to the database in bulk.
+void ModuleWiki::CommitImport(User* user, const WikiImport& changes) {
+    WikiEntrySet added;
+    WikiEntrySet removed;
+
+    const auto exists = [&](const WikiEntry& entry) {
+        if (added.count(entry))
+            return true;
+        if (removed.count(entry))
+            return false;
+        return HasWikiEntry(entry.first, entry.second);
+    };
+
+    const auto add = [&](WikiEntry entry) {
+        if (exists(entry))
+            return false;
+        if (!removed.erase(entry))
+            added.insert(std::move(entry));
+        return true;
+    };
+
+    const auto remove = [&](WikiEntry entry) {
+        if (!exists(entry))
+            return false;
+        if (!added.erase(entry))
+            removed.insert(std::move(entry));
+        return true;
+    };
 
-    sql->Submit(new WikiQuery(this, WikiOp::DELETE), query);
+    size_t skipped = 0;
+    for (const auto& change : changes) {
+        if (change.add) {
+            skipped += !add({ change.keyword, change.slug });
+        } else if (!change.slug.empty()) {
+            skipped += !remove({ change.keyword, change.slug });
+        } else {
+            //  Every slug the keyword has at this point in the import.
+            std::vector<std::string> slugs;
+            GetWikiSlugs(change.keyword, slugs);
+            for (auto it = added.lower_bound({ change.keyword, "" }); it != added.end() && it->first == change.keyword; ++it)
+                slugs.push_back(it->second);
+
+            size_t count = 0;
+            for (const auto& slug : slugs)
+                count += remove({ change.keyword, slug });
+            skipped += !count;
+        }
+    }
+
+    for (const auto& [keyword, slug] : removed)
+        RemoveWikiEntry(keyword, slug);
+    for (const auto& [keyword, slug] : added)
+        AddWikiEntry(keyword, slug);
+    if (matcherDirty)
+        RebuildMatcher();
+
+    //  The oper is told the import is complete once the database has it.
+    auto batch = std::make_shared<WikiWriteBatch>();
+    batch->uuid = user->uuid;
+    batch->summary = "*** [wiki] Import complete: " + ConvToStr(added.size()) + " slug(s) added, "
+        + ConvToStr(removed.size()) + " removed, " + ConvToStr(skipped) + " skipped.";
+    WriteEntries(added, removed, batch);
 }
 
-void ModuleWiki::OnShow(User* user, const std::string& rawKey) {
-    if (!sql) {
-        user->WriteNotice("*** [wiki] SQL database is not available.");
+void ModuleWiki::OnShow(User* user, const std::string& pattern, size_t page) {
+    //  An exact keyword shows all of its pages.
+    auto exact = wikiCache.find(pattern);
+    if (exact != wikiCache.end()) {
+        std::vector<std::string> slugs = exact->second;
+        std::sort(slugs.begin(), slugs.end());
+
+        std::vector<std::string> lines;
+        lines.reserve(slugs.size() + 1);
+        lines.push_back("*** [wiki] Wiki Page for '" + pattern + "':");
+        for (const auto& slug : slugs)
+            lines.push_back(GetWikiPrefix() + slug);
+        SendLines(user, lines);
         return;
     }
 
-    if (rawKey.empty()) {
-        sql->Submit(new WikiQuery(this, WikiOp::SHOWALL, user->uuid), "SELECT keyword, slug FROM wiki_entries");
-    } else {
-        sql->Submit(new WikiQuery(this, WikiOp::SHOWONE, user->uuid + " " + rawKey),
-            INSP_FORMAT("SELECT keyword, slug FROM wiki_entries WHERE keyword = '{}' ORDER BY slug ASC", EscapeString(rawKey)));
+    const std::string mask = pattern.empty() ? "*" : pattern;
+    size_t total = 0;
+    for (const auto& [keyword, slugs] : wikiCache) {
+        if (InspIRCd::Match(keyword, mask))
+            total += slugs.size();
+    }
+
+    if (!total) {
+        user->WriteNotice("*** [wiki] No wiki pages found for '" + mask + "'.");
+        return;
     }
+
+    const size_t pages = (total + showPageSize - 1) / showPageSize;
+    if (page > pages) {
+        user->WriteNotice("*** [wiki] There are only " + ConvToStr(pages) + " page(s) for '" + mask + "'.");
+        return;
+    }
+
+    //  Only the lines on the requested page are built.
+    const size_t first = (page - 1) * showPageSize;
+    const size_t last = first + showPageSize;
+    std::vector<std::string> lines;
+    lines.reserve(showPageSize + 2);
+    lines.push_back("*** [wiki] Wiki's matching '" + mask + "' (" + ConvToStr(total) + " page(s), showing " + ConvToStr(page) + "/" + ConvToStr(pages) + "):");
+
+    size_t index = 0;
+    for (const auto& [keyword, slugs] : wikiCache) {
+        if (index >= last)
+            break;
+
+        if (!InspIRCd::Match(keyword, mask))
+            continue;
+
+        for (const auto& slug : slugs) {
+            if (index >= first && index < last)
+                lines.push_back(keyword + " -> " + GetWikiPrefix() + slug);
+            index++;
+        }
+    }
+
+    if (page < pages)
+        lines.push_back("*** [wiki] Use WIKI SHOW " + mask + " " + ConvToStr(page + 1) + " for the next page.");
+
+    SendLines(user, lines);
 }
 
 CmdResult ModuleWiki::CommandWiki::Handle(User* user, const Params& parameters) {
@@ -380,7 +937,36 @@ CmdResult ModuleWiki::CommandWiki::Handle(User* user, const Params& parameters)
     std::string subcmd = parameters[0];
     std::transform(subcmd.begin(), subcmd.end(), subcmd.begin(), ::toupper);
 
-    if (subcmd == "ADD") {
+    WikiImport* import = mod->importExt.Get(user);
+    if (subcmd == "IMPORT") {
+        std::string action = parameters.size() > 1 ? parameters[1] : "";
+        std::transform(action.begin(), action.end(), action.begin(), ::toupper);
+
+        if (action == "BEGIN") {
+            if (import) {
+                user->WriteNotice("*** [wiki] An import is already in progress.");
+                return CmdResult::FAILURE;
+            }
+            mod->importExt.Set(user, WikiImport());
+            user->WriteNotice("*** [wiki] Import started. WIKI ADD and WIKI DEL are queued until WIKI IMPORT END.");
+            return CmdResult::SUCCESS;
+        } else if (action == "END" || action == "ABORT") {
+            if (!import) {
+                user->WriteNotice("*** [wiki] No import is in progress.");
+                return CmdResult::FAILURE;
+            }
+
+            if (action == "END")
+                mod->CommitImport(user, *import);
+            else
+                user->WriteNotice("*** [wiki] Import aborted, " + ConvToStr(import->size()) + " change(s) discarded.");
+            mod->importExt.Unset(user);
+            return CmdResult::SUCCESS;
+        }
+
+        user->WriteNotice("*** [wiki] Usage: WIKI IMPORT {BEGIN|END|ABORT}");
+        return CmdResult::FAILURE;
+    } else if (subcmd == "ADD") {
         if (parameters.size() < 3) {
             user->WriteNotice("*** [wiki] Usage: WIKI ADD <keyword> <slug>");
             return CmdResult::FAILURE;
@@ -388,6 +974,10 @@ CmdResult ModuleWiki::CommandWiki::Handle(User* user, const Params& parameters)
 
         std::string rawKey = parameters[1];
         std::string slug = parameters[2];
+        if (import) {
+            import->push_back({ true, rawKey, slug });
+            return CmdResult::SUCCESS;
+        }
 
         //  Check duplication
         auto it = mod->wikiCache.find(rawKey);
@@ -409,10 +999,15 @@ CmdResult ModuleWiki::CommandWiki::Handle(User* user, const Params& parameters)
         }
 
         std::string rawKey = parameters[1];
+        if (import) {
+            import->push_back({ false, rawKey, parameters.size() > 2 ? parameters[2] : "" });
+            return CmdResult::SUCCESS;
+        }
+
         if (parameters.size() == 2) {
 
             mod->DoDeleteAll(rawKey);
-            mod->wikiCache.erase(rawKey);
+            mod->RemoveWikiKeyword(rawKey);
             user->WriteNotice("*** [wiki] All slugs deleted for keyword '" + rawKey + "'.");
             return CmdResult::SUCCESS;
         } else {
@@ -428,12 +1023,26 @@ CmdResult ModuleWiki::CommandWiki::Handle(User* user, const Params& parameters)
             }
         }
     } else if (subcmd == "SHOW") {
-        std::string fullKey = parameters.size() > 1
-            ? std::accumulate(parameters.begin() + 1, parameters.end(), std::string(),
-                [](const std::string& a, const std::string& b) { return a + (a.empty() ? "" : " ") + b; })
-            : "";
+        std::string fullKey = std::accumulate(parameters.begin() + 1, parameters.end(), std::string(),
+            [](const std::string& a, const std::string& b) { return a + (a.empty() ? "" : " ") + b; });
+
+        //  A trailing number is the page to show. The last parameter holds
+        //  everything after the second one so the number is split off it
+        //  rather than expected as a parameter of its own.
+        size_t page = 1;
+        const size_t space = fullKey.find_last_of(' ');
+        const size_t start = space == std::string::npos ? 0 : space + 1;
+        if (start < fullKey.length() && std::all_of(fullKey.begin() + start, fullKey.end(), [](unsigned char c) { return std::isdigit(c); })) {
+            page = ConvToNum<size_t>(fullKey.substr(start));
+            fullKey.erase(space == std::string::npos ? 0 : space);
+        }
+
+        if (!page) {
+            user->WriteNotice("*** [wiki] Usage: WIKI SHOW [<keyword>|<pattern>] [<page>]");
+            return CmdResult::FAILURE;
+        }
 
-        mod->OnShow(user, fullKey);
+        mod->OnShow(user, fullKey, page);
         return CmdResult::SUCCESS;
     }
 
@@ -472,13 +1081,14 @@ CmdResult ModuleWiki::CommandSend::Handle(User* user, const Params& parameters)
     }
 
     //  Decide whether to send all slugs or a single one. Here, we'll send all.
-    std::string fullUrl;
+    std::vector<std::string> lines;
+    lines.reserve(slugs.size());
     for (const auto& slug : slugs) {
-        fullUrl += "*** [wiki] Wiki page '" + rawKey + "': " + mod->GetWikiPrefix() + slug + "\n";
+        lines.push_back("*** [wiki] Wiki page '" + rawKey + "': " + mod->GetWikiPrefix() + slug);
     }
 
     //  Send the notice to the target user.
-    mod->WriteSplitNotice(targetUser, fullUrl);
+    mod->SendLines(targetUser, lines);
 
     //  Notify the sender about the successful delivery.
     user->WriteNotice("*** [wiki] Wiki page sent " + std::to_string(slugs.size()) + " url(s) for '" + rawKey + "' to " + targetNick + ".");
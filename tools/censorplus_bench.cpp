@@ -0,0 +1,377 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *   Copyright (C) 2015-2016 reverse Chevronnet  mike.chevronnet@gmail.com
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software; you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Replays a corpus of message lines through the m_censorplus filter pipeline
+ * without a running ircd and reports what each stage costs. This is intended
+ * to be run against a new whitelistregex, emojiregex, kiwiircregex or badword
+ * list before it is deployed.
+ *
+ * Build:
+ *   c++ -std=c++17 -O2 -march=native -I/usr/local/include tools/censorplus_bench.cpp \
+ *     -o censorplus_bench $(pkg-config --cflags --libs icu-uc icu-i18n) -L/usr/local/lib -lhs
+ *
+ * Usage:
+ *   censorplus_bench [-w whitelistregex] [-e emojiregex] [-k kiwiircregex]
+ *     [-b badwords.txt] [-n iterations] [-c] corpus.txt
+ *
+ * The corpus has one message per line. The badword file has one badword per
+ * line with an optional replacement after a tab; an empty replacement blocks
+ * the message like <badword replace=""> does. -c disables the codepoint
+ * classifier so that the ICU fallback can be measured.
+ */
+
+#define CENSORPLUS_BENCHMARK
+#include "../m_censorplus.cpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <unicode/uclean.h>
+
+// Every allocation made by the process is counted so that the pipeline can be
+// checked for allocations per message.
+static unsigned long long allocations = 0;
+
+void* operator new(size_t size)
+{
+	allocations++;
+	if (void* ptr = std::malloc(size ? size : 1))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+	std::free(ptr);
+}
+
+// ICU allocates through its own hooks rather than operator new.
+static void* U_CALLCONV CountingAlloc(const void*, size_t size)
+{
+	allocations++;
+	return std::malloc(size);
+}
+
+static void* U_CALLCONV CountingRealloc(const void*, void* ptr, size_t size)
+{
+	allocations++;
+	return std::realloc(ptr, size);
+}
+
+static void U_CALLCONV CountingFree(const void*, void* ptr)
+{
+	std::free(ptr);
+}
+
+namespace
+{
+	using Clock = std::chrono::steady_clock;
+
+	enum Stage
+	{
+		STAGE_CLASSIFY,
+		STAGE_WHITELIST,
+		STAGE_EMOJI,
+		STAGE_KIWIIRC,
+		STAGE_BADWORDS,
+		STAGE_TOTAL,
+		STAGE_COUNT
+	};
+
+	const char* const stage_names[STAGE_COUNT] = {
+		"classify",
+		"whitelist",
+		"emoji",
+		"kiwiirc",
+		"badwords",
+		"total"
+	};
+
+	struct StageTimings final
+	{
+		std::vector<unsigned long long> samples;
+		unsigned long long total = 0;
+
+		void Add(Clock::time_point start, Clock::time_point end)
+		{
+			const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+			samples.push_back(ns);
+			total += ns;
+		}
+	};
+
+	[[noreturn]] void Usage(const char* argv0)
+	{
+		std::cerr << "Usage: " << argv0 << " [-w whitelistregex] [-e emojiregex] [-k kiwiircregex] [-b badwords.txt] [-n iterations] [-c] corpus.txt" << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+
+	[[noreturn]] void Fail(const std::string& message)
+	{
+		std::cerr << message << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+
+	bool ReadLines(const std::string& path, std::vector<std::string>& lines)
+	{
+		std::ifstream stream(path);
+		if (!stream)
+			return false;
+
+		std::string line;
+		while (std::getline(stream, line))
+		{
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			lines.push_back(line);
+		}
+		return true;
+	}
+
+	unsigned long long Percentile(std::vector<unsigned long long>& samples, double percentile)
+	{
+		if (samples.empty())
+			return 0;
+
+		const size_t index = std::min(samples.size() - 1, static_cast<size_t>(percentile * samples.size()));
+		std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+		return samples[index];
+	}
+}
+
+int main(int argc, char** argv)
+{
+	UErrorCode icu_status = U_ZERO_ERROR;
+	u_setMemoryFunctions(nullptr, CountingAlloc, CountingRealloc, CountingFree, &icu_status);
+
+	std::string whitelist_regex;
+	std::string emoji_regex;
+	std::string kiwiirc_regex;
+	std::string badword_path;
+	std::string corpus_path;
+	unsigned long iterations = 1;
+	bool use_classifier = true;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string arg = argv[i];
+		const bool hasvalue = i + 1 < argc;
+		if (arg == "-w" && hasvalue)
+			whitelist_regex = argv[++i];
+		else if (arg == "-e" && hasvalue)
+			emoji_regex = argv[++i];
+		else if (arg == "-k" && hasvalue)
+			kiwiirc_regex = argv[++i];
+		else if (arg == "-b" && hasvalue)
+			badword_path = argv[++i];
+		else if (arg == "-n" && hasvalue)
+			iterations = std::max(1UL, std::strtoul(argv[++i], nullptr, 10));
+		else if (arg == "-c")
+			use_classifier = false;
+		else if (corpus_path.empty() && arg[0] != '-')
+			corpus_path = arg;
+		else
+			Usage(argv[0]);
+	}
+
+	if (corpus_path.empty())
+		Usage(argv[0]);
+
+	std::vector<std::string> corpus;
+	if (!ReadLines(corpus_path, corpus))
+		Fail("Unable to read the corpus from " + corpus_path);
+
+	std::string error;
+	hs_scratch_t* scratch = nullptr;
+	hs_database_t* whitelist_db = nullptr;
+	if (!whitelist_regex.empty())
+	{
+		if (!CompileRegex(whitelist_regex, &whitelist_db, error))
+			Fail(error);
+
+		if (hs_alloc_scratch(whitelist_db, &scratch) != HS_SUCCESS)
+			Fail("Failed to allocate Hyperscan scratch space");
+	}
+
+	CharacterPattern emoji_pattern;
+	if (!emoji_pattern.Compile(emoji_regex, use_classifier, error))
+		Fail("Failed to compile emoji regex pattern: " + error);
+
+	CharacterPattern kiwiirc_pattern;
+	if (!kiwiirc_pattern.Compile(kiwiirc_regex, use_classifier, error))
+		Fail("Failed to compile KiwiIRC regex pattern: " + error);
+
+	BadwordList badwords;
+	if (!badword_path.empty())
+	{
+		std::vector<std::string> lines;
+		if (!ReadLines(badword_path, lines))
+			Fail("Unable to read the badwords from " + badword_path);
+
+		std::vector<std::pair<std::string, std::string>> entries;
+		for (const auto& line : lines)
+		{
+			if (line.empty())
+				continue;
+
+			const size_t tab = line.find('\t');
+			if (tab == std::string::npos)
+				entries.emplace_back(line, "");
+			else
+				entries.emplace_back(line.substr(0, tab), line.substr(tab + 1));
+		}
+
+		if (!badwords.Compile(std::move(entries), error))
+			Fail("Failed to compile badword patterns for Hyperscan: " + error);
+
+		if (badwords.GetDatabase() && hs_alloc_scratch(badwords.GetDatabase(), &scratch) != HS_SUCCESS)
+			Fail("Failed to allocate Hyperscan scratch space for badwords");
+	}
+
+	std::cout << "emojiregex backend: " << (emoji_pattern.UsesClassifier() ? "codepoint classifier" : "ICU") << std::endl;
+	std::cout << "kiwiircregex backend: " << (kiwiirc_pattern.UsesClassifier() ? "codepoint classifier" : "ICU") << std::endl;
+
+	StageTimings timings[STAGE_COUNT];
+	for (auto& timing : timings)
+		timing.samples.reserve(corpus.size() * iterations);
+
+	unsigned long long messages = 0;
+	unsigned long long blocked_characters = 0;
+	unsigned long long blocked_badwords = 0;
+	unsigned long long rewritten = 0;
+	unsigned long long errors = 0;
+	std::string censored;
+	censored.reserve(4096);
+
+	const unsigned long long allocations_before = allocations;
+	for (unsigned long iteration = 0; iteration < iterations; ++iteration)
+	{
+		for (const auto& text : corpus)
+		{
+			messages++;
+			const Clock::time_point start = Clock::now();
+
+			Clock::time_point stage_start = start;
+			const TextType type = ClassifyText(text);
+			Clock::time_point stage_end = Clock::now();
+			timings[STAGE_CLASSIFY].Add(stage_start, stage_end);
+
+			bool allowed = type == TextType::PRINTABLE_ASCII;
+			if (type == TextType::SINGLE_SCRIPT)
+			{
+				bool failed = false;
+				stage_start = stage_end;
+				allowed = IsWhitelisted(whitelist_db, scratch, text, failed);
+				stage_end = Clock::now();
+				timings[STAGE_WHITELIST].Add(stage_start, stage_end);
+				errors += failed;
+
+				UErrorCode status = U_ZERO_ERROR;
+				if (!allowed)
+				{
+					stage_start = stage_end;
+					allowed = emoji_pattern.Matches(text, status);
+					stage_end = Clock::now();
+					timings[STAGE_EMOJI].Add(stage_start, stage_end);
+				}
+
+				if (!allowed)
+				{
+					stage_start = stage_end;
+					allowed = kiwiirc_pattern.Matches(text, status);
+					stage_end = Clock::now();
+					timings[STAGE_KIWIIRC].Add(stage_start, stage_end);
+				}
+				errors += U_FAILURE(status);
+			}
+
+			if (!allowed)
+			{
+				blocked_characters++;
+				timings[STAGE_TOTAL].Add(start, stage_end);
+				continue;
+			}
+
+			bool failed = false;
+			size_t blocked = SIZE_MAX;
+			stage_start = stage_end;
+			const Verdict verdict = badwords.Scan(text, scratch, censored, blocked, failed);
+			stage_end = Clock::now();
+			timings[STAGE_BADWORDS].Add(stage_start, stage_end);
+			timings[STAGE_TOTAL].Add(start, stage_end);
+			errors += failed;
+
+			if (verdict == Verdict::BLOCK_BADWORD)
+				blocked_badwords++;
+			else if (verdict == Verdict::REWRITE)
+				rewritten++;
+		}
+	}
+	const unsigned long long allocations_used = allocations - allocations_before;
+
+	std::printf("\n%-10s %12s %12s %10s %10s %10s\n", "stage", "messages", "ns/message", "p50 ns", "p99 ns", "max ns");
+	for (size_t stage = 0; stage < STAGE_COUNT; ++stage)
+	{
+		auto& timing = timings[stage];
+		const size_t count = timing.samples.size();
+		const unsigned long long mean = count ? timing.total / count : 0;
+		const unsigned long long max = count ? *std::max_element(timing.samples.begin(), timing.samples.end()) : 0;
+		const unsigned long long p50 = Percentile(timing.samples, 0.50);
+		const unsigned long long p99 = Percentile(timing.samples, 0.99);
+		std::printf("%-10s %12zu %12llu %10llu %10llu %10llu\n", stage_names[stage], count, mean, p50, p99, max);
+	}
+
+	const double total = messages ? static_cast<double>(messages) : 1.0;
+	std::printf("\nmessages: %llu\n", messages);
+	std::printf("allocations/message: %.2f\n", allocations_used / total);
+	std::printf("blocked (characters): %llu (%.2f%%)\n", blocked_characters, 100.0 * blocked_characters / total);
+	std::printf("blocked (badwords): %llu (%.2f%%)\n", blocked_badwords, 100.0 * blocked_badwords / total);
+	std::printf("block rate: %.2f%%\n", 100.0 * (blocked_characters + blocked_badwords) / total);
+	std::printf("rewritten: %llu (%.2f%%)\n", rewritten, 100.0 * rewritten / total);
+	if (errors)
+		std::printf("scan errors: %llu\n", errors);
+
+	if (whitelist_db)
+		hs_free_database(whitelist_db);
+	if (scratch)
+		hs_free_scratch(scratch);
+	return EXIT_SUCCESS;
+}
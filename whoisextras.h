@@ -0,0 +1,181 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *   Copyright (C) 2025 Jean Chevronnet <mike.chevronnet@gmail.com>
+ *
+ * This file contains a third party module header for InspIRCd.  You can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A per-user record of formatted WHOIS lines shared by the WHOIS modules in
+ * this repository (geomaxlite, profileLink, ircv3_sni and whoisport). Install
+ * it next to the modules which include it.
+ *
+ * Each module owns one field of the record. A field is built the first time a
+ * WHOIS needs it and reused until the data it was built from changes or the
+ * module invalidates it. The record is stored in a single "whois-extras"
+ * extension item which is registered by whichever of these modules needs it
+ * first and re-registered by another if that module is unloaded.
+ */
+
+#pragma once
+
+#include "extension.h"
+
+#include <array>
+#include <chrono>
+#include <memory>
+
+namespace WhoisExtras
+{
+	/** The fields of the record, one per module. */
+	enum Field : uint8_t
+	{
+		GEOLOCATION,
+		PROFILE,
+		SNI,
+		PORT,
+		FIELD_COUNT
+	};
+
+	class Cache;
+	class ExtItem;
+	struct Record;
+
+	inline const std::string EXTENSION_NAME = "whois-extras";
+}
+
+struct WhoisExtras::Record final
+{
+	struct Entry final
+	{
+		/** The data the line was built from. */
+		std::string key;
+
+		/** The formatted line. */
+		std::string line;
+
+		/** The generation of the cache which built the line. */
+		uint64_t generation = 0;
+
+		/** Whether this entry has been built. */
+		bool valid = false;
+	};
+
+	std::array<Entry, FIELD_COUNT> entries;
+};
+
+class WhoisExtras::ExtItem final
+	: public ExtensionItem
+{
+public:
+	ExtItem(Module* mod)
+		: ExtensionItem(mod, EXTENSION_NAME, ExtensionType::USER)
+	{
+	}
+
+	Record* Get(const Extensible* container) const
+	{
+		return static_cast<Record*>(GetRaw(container));
+	}
+
+	Record& GetOrCreate(Extensible* container)
+	{
+		Record* record = Get(container);
+		if (!record)
+		{
+			record = new Record();
+			SetRaw(container, record);
+		}
+		return *record;
+	}
+
+	void Delete(Extensible* container, void* item) override
+	{
+		delete static_cast<Record*>(item);
+	}
+};
+
+/** A module's handle on its field of the shared record. */
+class WhoisExtras::Cache final
+{
+private:
+	Module* const creator;
+	const Field field;
+
+	/** The extension item if this module had to register it. */
+	std::unique_ptr<ExtItem> owned;
+
+	/** Lines built by an earlier generation are stale. */
+	uint64_t generation;
+
+	ExtItem* Find() const
+	{
+		// Looked up every time as the module which registered it may be unloaded.
+		return static_cast<ExtItem*>(ServerInstance->Extensions.GetItem(EXTENSION_NAME));
+	}
+
+	ExtItem& FindOrRegister()
+	{
+		ExtItem* item = Find();
+		if (!item)
+		{
+			owned = std::make_unique<ExtItem>(creator);
+			ServerInstance->Modules.AddService(*owned);
+			item = owned.get();
+		}
+		return *item;
+	}
+
+public:
+	Cache(Module* mod, Field f)
+		: creator(mod)
+		, field(f)
+	{
+		Reset();
+	}
+
+	/** Retrieves the line for a user.
+	 * @param user The user the line is about.
+	 * @param key The data the line is built from; the line is rebuilt if this changed.
+	 * @param build Called with the key to build the line if it is not cached.
+	 */
+	template<typename Builder>
+	const std::string& Get(User* user, const std::string& key, Builder&& build)
+	{
+		Record::Entry& entry = FindOrRegister().GetOrCreate(user).entries[field];
+		if (!entry.valid || entry.generation != generation || entry.key != key)
+		{
+			entry.line = build(key);
+			entry.key = key;
+			entry.generation = generation;
+			entry.valid = true;
+		}
+		return entry.line;
+	}
+
+	/** Forgets the lines for every user, e.g. because the format of the line was reconfigured. */
+	void Reset()
+	{
+		// A timestamp rather than a counter so it never repeats if the module is reloaded.
+		generation = std::chrono::steady_clock::now().time_since_epoch().count();
+	}
+
+	/** Forgets the line for a user, e.g. because their account, address or TLS session changed. */
+	void Invalidate(User* user)
+	{
+		ExtItem* item = Find();
+		Record* record = item ? item->Get(user) : nullptr;
+		if (record)
+			record->entries[field] = Record::Entry();
+	}
+};